@@ -3,65 +3,116 @@
 #include <gl/glu.h>
 #include "glut.h"
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
 #include <math.h>
+#include <climits>
+#include <cfloat>
+#include <algorithm>
+#include <unordered_map>
+#include <iterator>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define LIGHT_SSE2
+#endif
 using namespace std;
 
 /*
 
-g++ -o light.exe -Wall Light.cpp glut32.lib -lopengl32 -lglu32
+g++ -std=c++11 -o light.exe -Wall Light.cpp glut32.lib -lopengl32 -lglu32
+
+needs a mingw with posix threads for std::thread
+
+add -DLIGHT_DOUBLE to shade in double instead of float
+run "light.exe -precision" to check the float path against double
 
 */
 
 
-class Point3
+//scalar type of the shading path, float for the fast path, double to validate it
+//g++ -DLIGHT_DOUBLE ... builds the all-double version
+#ifdef LIGHT_DOUBLE
+typedef double Real;
+#else
+typedef float Real;
+#endif
+
+template <typename T>
+class Point3T
 {
     public:
-        float x, y, z;
+        T x, y, z;
+
+    Point3T() {};
+    Point3T(T x, T y, T z) : x(x), y(y), z(z) {}
 
-    Point3() {};
-    Point3(float x, float y, float z) : x(x), y(y), z(z) {}
+    //convert from the other precision
+    template <typename U>
+    explicit Point3T(const Point3T<U>& p) : x((T)p.x), y((T)p.y), z((T)p.z) {}
 
-    void set(Point3 p) { x = p.x; y = p.y; z = p.z; }
+    void set(Point3T p) { x = p.x; y = p.y; z = p.z; }
 };
 
-class Vector3 {
+template <typename T>
+class Vector3T {
 
     public:
 
         // -------------------- Attributes -------------------- //
 
         // Components of the vector
-        float x, y, z;
+        T x, y, z;
 
         
 
         // -------------------- Methods -------------------- //
 
         // Constructor
-        Vector3(float x = 0, float y = 0, float z = 0) : x(x), y(y), z(z) {}
+        Vector3T(T x = 0, T y = 0, T z = 0) : x(x), y(y), z(z) {}
 
         // Constructor
-        Vector3(const Vector3& vector) : x(vector.x), y(vector.y), z(vector.z) {}
+        Vector3T(const Vector3T& vector) : x(vector.x), y(vector.y), z(vector.z) {}
         //return the s vector from two points, shape, sun/eye
-        Vector3(Point3 a, Point3 b) : x(b.x - a.x), y(b.y - a.y), z(b.z - a.z) {}
+        Vector3T(Point3T<T> a, Point3T<T> b) : x(b.x - a.x), y(b.y - a.y), z(b.z - a.z) {}
+        //convert from the other precision
+        template <typename U>
+        explicit Vector3T(const Vector3T<U>& v) : x((T)v.x), y((T)v.y), z((T)v.z) {}
         // Constructor
-        ~Vector3() {}
+        ~Vector3T() {}
 
 
-        //set vector with floats
-        void set(float xx, float yy, float zz) { x = xx; y = yy; z = zz; }
+        //set vector with scalars
+        void set(T xx, T yy, T zz) { x = xx; y = yy; z = zz; }
 
         //set vector with a point3
-        void set(Point3 p) { x = p.x; y = p.y; z = p.z; }
+        void set(Point3T<T> p) { x = p.x; y = p.y; z = p.z; }
 
         //set vector with a vector
-        void set(Vector3 v) { x = v.x; y = v.y; z = v.z; }
+        void set(Vector3T v) { x = v.x; y = v.y; z = v.z; }
 
         //return the opposite vector of the given vector
-        Vector3 negative() { return Vector3(-1*x, -1*y, -1*z); }
+        Vector3T negative() { return Vector3T(-1*x, -1*y, -1*z); }
 
         // = operator
-        Vector3& operator=(const Vector3& vector) {
+        Vector3T& operator=(const Vector3T& vector) {
             if (&vector != this) {
                 x = vector.x;
                 y = vector.y;
@@ -71,80 +122,80 @@ class Vector3 {
         }
 
         // + operator
-        Vector3 operator+(const Vector3 &v) const {
-            return Vector3(x + v.x, y + v.y, z + v.z);
+        Vector3T operator+(const Vector3T &v) const {
+            return Vector3T(x + v.x, y + v.y, z + v.z);
         }
 
         // += operator
-        Vector3& operator+=(const Vector3 &v) {
+        Vector3T& operator+=(const Vector3T &v) {
             x += v.x; y += v.y; z += v.z;
             return *this;
         }
 
         // - operator
-        Vector3 operator-(const Vector3 &v) const {
-            return Vector3(x - v.x, y - v.y, z - v.z);
+        Vector3T operator-(const Vector3T &v) const {
+            return Vector3T(x - v.x, y - v.y, z - v.z);
         }
 
         // -= operator
-        Vector3& operator-=(const Vector3 &v) {
+        Vector3T& operator-=(const Vector3T &v) {
             x -= v.x; y -= v.y; z -= v.z;
             return *this;
         }
 
         // == operator
-        bool operator==(const Vector3 &v) const {
+        bool operator==(const Vector3T &v) const {
             return x == v.x && y == v.y && z == v.z;
         }
 
         // != operator
-        bool operator!=(const Vector3 &v) const {
+        bool operator!=(const Vector3T &v) const {
           return !( *this == v );
         }
 
         // * operator
-        Vector3 operator*(float f) const {
-            return Vector3(f*x, f*y, f*z);
+        Vector3T operator*(T f) const {
+            return Vector3T(f*x, f*y, f*z);
         }
 
         // *= operator
-        Vector3 &operator*=(float f) {
+        Vector3T &operator*=(T f) {
             x *= f; y *= f; z *= f;
             return *this;
         }
 
         // / operator
-        Vector3 operator/(float f) const {
-            float inv = 1.f / f;
-            return Vector3(x * inv, y * inv, z * inv);
+        Vector3T operator/(T f) const {
+            T inv = T(1) / f;
+            return Vector3T(x * inv, y * inv, z * inv);
         }
 
         // /= operator
-        Vector3 &operator/=(float f) {
-            float inv = 1.f / f;
+        Vector3T &operator/=(T f) {
+            T inv = T(1) / f;
             x *= inv; y *= inv; z *= inv;
             return *this;
         }
 
         // - operator
-        Vector3 operator-() const {
-            return Vector3(-x, -y, -z);
+        Vector3T operator-() const {
+            return Vector3T(-x, -y, -z);
         }
 
 
         // Cross product operator
-        Vector3 cross(const Vector3 &v) const{
-            return Vector3(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
+        Vector3T cross(const Vector3T &v) const{
+            return Vector3T(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
         }
 
         // Dot product operator
-        float dot(const Vector3 &v) const{
+        T dot(const Vector3T &v) const{
             return x * v.x + y * v.y + z * v.z;
         }
 
         // Normalize the vector and return it
-        Vector3 normalize() {
-            float l = magnitude();
+        Vector3T normalize() {
+            T l = magnitude();
 
             x /= l;
             y /= l;
@@ -153,13 +204,19 @@ class Vector3 {
         }
 
         // Return the squared length of the vector
-        float lengthSquared() const { return x*x + y*y + z*z; }
+        T lengthSquared() const { return x*x + y*y + z*z; }
 
         // Return the length of the vector
-        float magnitude() const { return sqrt(lengthSquared()); }
+        T magnitude() const { return sqrt(lengthSquared()); }
 
 };
 
+typedef Point3T<Real> Point3;
+typedef Vector3T<Real> Vector3;
+
+//false until main has opened the window, the headless modes only use the camera math
+bool glReady = false;
+
 class Camera {
     public:
         Point3 eye, look;
@@ -190,6 +247,8 @@ void Camera::setModelviewMatrix(void)
     m[2] = n.x; m[6] = n.y; m[10] = n.z; m[14] = -eVec.dot(n);
     m[3] = 0;   m[7] = 0;   m[11] = 0;   m[15] = 1.0;
 
+    if (!glReady)
+        return;
     glMatrixMode(GL_MODELVIEW);
     glLoadMatrixf(m); //load openGL modelview matrix
 }
@@ -225,6 +284,8 @@ void Camera::setShape(float vAng, float asp, float nearD, float farD)
     nearDist = nearD;
     farDist = farD; 
 
+    if (!glReady)
+        return;
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
     gluPerspective(vAng, asp, nearD, farD);
@@ -307,12 +368,13 @@ int spin = 0;
 
 //lambert pg 384 ------------------------------------ 
 //Returns Id
-double lambert(Vector3 s, Vector3 m) {
-    float top = s.dot(m);
-    float bottom = s.magnitude() * m.magnitude();
+template <typename T>
+T lambert(Vector3T<T> s, Vector3T<T> m) {
+    T top = s.dot(m);
+    T bottom = s.magnitude() * m.magnitude();
 
-    float n = top/bottom;
-    float lambert = max((float)0, n);
+    T n = top/bottom;
+    T lambert = max(T(0), n);
 
     //Is and Pd are global
     //return Is * Pd * lambert;;
@@ -325,18 +387,18 @@ double lambert(Vector3 s, Vector3 m) {
 //phong pg 387--------------------------------------
 //Adjusted Specular term
 //returns Isp
-double phong(Vector3 v, Vector3 s, Vector3 m, int f) {
+template <typename T>
+T phong(Vector3T<T> v, Vector3T<T> s, Vector3T<T> m, T f) {
         
-    Vector3 h = s + v;
+    Vector3T<T> h = s + v;
 
     //Is this correctly translated? pg 387
-    Vector3 left = (h/h.magnitude());
-    Vector3 right = (m/m.magnitude());
-    float frac = left.dot(right);
+    Vector3T<T> left = (h/h.magnitude());
+    Vector3T<T> right = (m/m.magnitude());
+    T frac = left.dot(right);
 
-    //pick an f value 1-200
-    float n = pow(frac,f);
-    float phong = max((float)0, n);
+    //pick an f value 1-200, clamp first so a fractional f never sees a negative base
+    T phong = pow(max(T(0), frac), f);
 
     //Is and Ps are global
     //return Is * Ps * phong;
@@ -344,475 +406,6672 @@ double phong(Vector3 v, Vector3 s, Vector3 m, int f) {
 }
 
 //-s + 2[(2dotm)/|m|^2]*m finding vector r... mirrior reflection direction
-Vector3 getR(Vector3 s, Vector3 m)
+template <typename T>
+Vector3T<T> getR(Vector3T<T> s, Vector3T<T> m)
 {
-    double top = s.dot(m);
-    double bottom = pow(m.magnitude(),2);
-    double fraction = top/bottom;
+    T top = s.dot(m);
+    T bottom = m.lengthSquared();
+    T fraction = top/bottom;
  
     return s.negative() + (m*(2*fraction));
 
 }
 
 //vector from shape --> sun/eye
-Vector3 getSV(Point3 shape, Point3 sun)
+template <typename T>
+Vector3T<T> getSV(Point3T<T> shape, Point3T<T> sun)
 {
-    return Vector3(shape, sun);
+    return Vector3T<T>(shape, sun);
 }
 
-double light(Vector3 s, Vector3 m, Vector3 v, double Ia, double Pa, double Id, double Pd, double Is, double Ps, int f) {
+template <typename T>
+T light(Vector3T<T> s, Vector3T<T> m, Vector3T<T> v, T Ia, T Pa, T Id, T Pd, T Is, T Ps, T f) {
     
     return (Ia * Pa) + (Id * Pd * lambert(s,m)) + ( Is * Ps * phong(v, s, m, f));
 
 }
 
-void drawNumbers()
+//float path against the double reference ----------
+//shades random s, m, v with both materials in both precisions and
+//fails if the float result drifts more than tol relative to the double one
+int precisionCheck(int samples, double tol)
 {
+    //f, Ia, Pa, Id, Pd, Is, Ps for one channel of brass and of silver
+    const double mats[2][7] = {
+        { 27.8974, .5, .329412, .5, .780392, 100, .992157 },
+        { 51.2,    .5, .19225,  .5, .50754,  100, .508273 }
+    };
+
+    srand(1);
+    double worst = 0;
+    int fails = 0;
+    for (int i = 0; i < samples; i++)
+    {
+        double r[9];
+        for (int k = 0; k < 9; k++)
+            r[k] = 20.0 * rand() / RAND_MAX - 10.0;
+
+        Vector3T<double> sd(r[0], r[1], r[2]), md(r[3], r[4], r[5]), vd(r[6], r[7], r[8]);
+        Vector3T<float> sf(sd), mf(md), vf(vd);
+        if (md.magnitude() < 1e-3 || (sd + vd).magnitude() < 1e-3)
+            continue;
+
+        const double *p = mats[i & 1];
+        double ld = light<double>(sd, md, vd, p[1], p[2], p[3], p[4], p[5], p[6], p[0]);
+        float lf = light<float>(sf, mf, vf, p[1], p[2], p[3], p[4], p[5], p[6], p[0]);
+
+        double err = fabs(lf - ld) / max(1.0, fabs(ld));
+        worst = max(worst, err);
+        if (err > tol)
+            fails++;
+    }
 
-    //
-    glRasterPos3d(.75, 1.15, 0);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '1');
+    cout << "precision check: " << samples << " samples, worst relative error " << worst
+         << (fails ? ", FAIL (" : ", PASS (") << fails << " over " << tol << ")\n";
+    return fails ? 1 : 0;
+}
 
-    //
-    glRasterPos3d(-.75, 1.15, 0);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '2');
+//worker pool --------------------------------------
+//a fixed set of threads started once, run() hands out task numbers
+//until they are all done, the calling thread works too as worker 0
+class WorkerPool
+{
+    public:
+        WorkerPool();
+        ~WorkerPool();
+
+        //number of workers including the caller
+        int size() const { return (int)threads.size() + 1; }
+
+        //call fn(task, worker) for every task in [0, tasks) and wait for them
+        void run(int tasks, const function<void(int, int)>& fn);
+
+    private:
+        void loop(int worker);
+        void work(int worker);
+
+        vector<thread> threads;
+        mutex lock;
+        condition_variable wake, done;
+        const function<void(int, int)>* job;
+        int jobTasks;
+        atomic<int> nextTask;
+        int busy;
+        unsigned generation;
+        bool quit;
+};
 
-    //
-    glRasterPos3d(.75, -1.15, 0);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '3');
+//set while a thread is inside run(), nested calls just run inline
+thread_local bool inPool = false;
 
-    //
-    glRasterPos3d(0, -.65, 1.25);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '4');
+WorkerPool::WorkerPool() : job(0), jobTasks(0), nextTask(0), busy(0), generation(0), quit(false)
+{
+    int count = max(1, (int)thread::hardware_concurrency());
+    for (int i = 1; i < count; i++)
+        threads.push_back(thread(&WorkerPool::loop, this, i));
+}
 
-    //
-    glRasterPos3d(0, .5, 1.25);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '5');
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> hold(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
 
-    //
-    glRasterPos3d(0, .5, -1.25);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '6');
+void WorkerPool::work(int worker)
+{
+    inPool = true;
+    for (int t = nextTask++; t < jobTasks; t = nextTask++)
+        (*job)(t, worker);
+    inPool = false;
+}
 
-    //
-    glRasterPos3d(0, -.65, -1.25);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '7');
+void WorkerPool::loop(int worker)
+{
+    unsigned seen = 0;
+    unique_lock<mutex> hold(lock);
+    for (;;)
+    {
+        wake.wait(hold, [&] { return quit || generation != seen; });
+        if (quit)
+            return;
+        seen = generation;
 
-    //
-    glRasterPos3d(-1.20, .10, .75);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '8');
+        hold.unlock();
+        work(worker);
+        hold.lock();
 
-    //
-    glRasterPos3d(-.75, -1.15, 0);
-    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '9');
-    
-    //
-    string str = "10";
-    glRasterPos3d(1.20, .10, -.60);
-    for (int i = 0; i < 2; i++)
-        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, (int)str[i]);
+        if (--busy == 0)
+            done.notify_all();
+    }
+}
 
-    //
-    str = "11";
-    glRasterPos3d(-1.20, .10, -.75);
-    for (int i = 0; i < 2; i++)
-        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, (int)str[i]);
-    
-    str = "12";
-    glRasterPos3d(1.20, .10, .60);
-    for (int i = 0; i < 2; i++)
-        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, (int)str[i]);
-    
+void WorkerPool::run(int tasks, const function<void(int, int)>& fn)
+{
+    if (tasks <= 0)
+        return;
+    if (inPool || threads.empty() || tasks == 1)
+    {
+        for (int t = 0; t < tasks; t++)
+            fn(t, 0);
+        return;
+    }
+
+    unique_lock<mutex> hold(lock);
+    job = &fn;
+    jobTasks = tasks;
+    nextTask = 0;
+    busy = (int)threads.size();
+    generation++;
+    hold.unlock();
+    wake.notify_all();
+
+    work(0);
+
+    hold.lock();
+    done.wait(hold, [&] { return busy == 0; });
+    job = 0;
 }
-  
-Point3 sunShine = Point3(15,20,10);
-bool GS = false;
 
-void display(void)
+WorkerPool& workers()
 {
+    static WorkerPool pool;
+    return pool;
+}
 
-    glClear(GL_COLOR_BUFFER_BIT);
-    //draw axis lines, x = red, y = green, z = blue
-    glPushMatrix();
-        axis(1);
-    glPopMatrix();
+//split [0, n) into runs of at least grain items, fn(begin, end, worker)
+void parallelFor(int n, int grain, const function<void(int, int, int)>& fn)
+{
+    int chunks = min(workers().size() * 4, (n + grain - 1) / max(1, grain));
+    if (chunks <= 1)
+    {
+        if (n > 0)
+            fn(0, n, 0);
+        return;
+    }
+    workers().run(chunks, [&](int t, int w) {
+        fn((int)((long long)n * t / chunks), (int)((long long)n * (t + 1) / chunks), w);
+    });
+}
 
+//metrics ------------------------------------------
+//counters the render path adds to as it goes, summed over the threads and
+//written out in prometheus text format every few seconds by a thread of their
+//own. each thread counts into its own cache line with plain relaxed stores, so
+//nothing is locked or bounced between cores, and the hot loops add once per
+//part, triangle or row block rather than once a sample
 
-    int f; 
+enum Metric
+{
+    METRIC_TRIANGLES,       //submitted to a renderer
+    METRIC_CULLED,          //of those, dropped before rasterizing
+    METRIC_VERTICES,        //lit per vertex
+    METRIC_PIXELS,          //rasterized and shaded
+    METRIC_LIGHT_CALLS,     //light() for one sample and one light
+    METRIC_POW_CALLS,       //of those, the ones that work out phong's pow
+    METRIC_CACHE_HITS,      //diffuse cache, in vertices
+    METRIC_CACHE_MISSES,
+    METRIC_FRAMES,
+    METRIC_FRAME_MICROS,
+    METRIC_FRAME_BUCKETS    //one per bucket of the frame time histogram from here
+};
 
-    //ambience
-    double Ia, Par, Pag, Pab;
+const double frameBuckets[] = { .002, .004, .008, .0167, .0333, .0667, .125, .25, .5, 1 };  //seconds
+const int FRAME_BUCKETS = sizeof(frameBuckets) / sizeof(frameBuckets[0]);
+const int METRICS = METRIC_FRAME_BUCKETS + FRAME_BUCKETS;
+const int METRIC_SLOTS = 64;    //threads past the last one share it
 
-    //diffuse
-    double Id, Pdr, Pdg, Pdb;
+struct alignas(64) MetricSlot
+{
+    atomic<unsigned long long> value[METRICS];
+};
 
-    //source intensity
-    double Is, Psr, Psg, Psb;
-    
-    if(GS)
-    {
-        //silver
-        f = 51.2;
-
-        Ia = .5;
-        Par = .19225;
-        Pag = .19225;
-        Pab = .19225;
-
-        Id = .5;
-        Pdr = .50754;
-        Pdg = .50754;
-        Pdb = .50754;
-
-        Is = 100;
-        Psr = .508273;
-        Psg = .508273;
-        Psb = .508273;
-    }
-    else 
-    {
-        //brass
-        f = 27.8974;
-
-        Ia = .5;
-        Par = .329412;
-        Pag = .223529;
-        Pab = .027451;
-
-        Id = .5;
-        Pdr = .780392;
-        Pdg = .568627;
-        Pdb = .113725;
-
-        Is = 100;
-        Psr = .992157;
-        Psg = .941176;
-        Psb = .807843;
-    }
-
-
-    //r g b values
-    double Ir, Ig, Ib;
-    //3 points for each triangle
-    Point3 a, b, c, center;
-    //calculate these for every vertex
-    Vector3 s, m, v, r;
-
-    //Start Triangles
-    a = Point3(1,1,-1);
-    b = Point3(1,-1,1);
-    c = Point3(1,-1,-1);
-    glBegin(GL_TRIANGLES);
-        //calculate m once per triangle
-        m = Vector3(a, c).cross(Vector3(b, c));
-
-        //s and v per vertices
-        s = Vector3(a, sunShine);
-        v = Vector3(a, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(a.x,a.y,a.z);
-
-        s = Vector3(b, sunShine);
-        v = Vector3(b, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(b.x,b.y,b.z);
-
-        s = Vector3(c, sunShine);
-        v = Vector3(c, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(c.x,c.y,c.z);
-    glEnd();
-    /*
-    glBegin(GL_LINES); //draw plane normal
-            center = Point3((a.x+b.x+c.x)/3.0, (a.y+b.y+c.y)/3.0, (a.z+b.z+c.z)/3.0);
-            m = Vector3(a, b).cross(Vector3(b, c));
-            glColor3f(.7,0,.7);
-            glVertex3d(center.x,center.y,center.z);
-            glVertex3d(m.x-2,m.y,m.z);
-    glEnd();*/
-
-    a = Point3(1,-1,1);
-    b = Point3(-1,1,1);
-    c = Point3(-1,-1,1);
-    glBegin(GL_TRIANGLES);
-        //calculate m once per triangle
-        m = Vector3(a, c).cross(Vector3(b, c));
-
-        //s and v per vertices
-        s = Vector3(a, sunShine);
-        v = Vector3(a, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(a.x,a.y,a.z);
-
-        s = Vector3(b, sunShine);
-        v = Vector3(b, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(b.x,b.y,b.z);
-
-        s = Vector3(c, sunShine);
-        v = Vector3(c, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(c.x,c.y,c.z);
-    glEnd();
-
-    a = Point3(-1,1,1);
-    b = Point3(1,1,-1);
-    c = Point3(-1,1,-1);
-    glBegin(GL_TRIANGLES);
-        //calculate m once per triangle
-        m = Vector3(a, c).cross(Vector3(b, c));
-
-        //s and v per vertices
-        s = Vector3(a, sunShine);
-        v = Vector3(a, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(a.x,a.y,a.z);
-
-        s = Vector3(b, sunShine);
-        v = Vector3(b, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(b.x,b.y,b.z);
-
-        s = Vector3(c, sunShine);
-        v = Vector3(c, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(c.x,c.y,c.z);
-    glEnd();
-
-
-    a = Point3(1,-1,1);
-    b = Point3(1,1,-1);
-    c = Point3(1,1,1);
-    glBegin(GL_TRIANGLES);
-        //calculate m once per triangle
-        m = Vector3(a, c).cross(Vector3(b, c));
-
-        //s and v per vertices
-        s = Vector3(a, sunShine);
-        v = Vector3(a, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(a.x,a.y,a.z);
-
-        s = Vector3(b, sunShine);
-        v = Vector3(b, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(b.x,b.y,b.z);
-
-        s = Vector3(c, sunShine);
-        v = Vector3(c, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(c.x,c.y,c.z);
-    glEnd();
-
-
-    a = Point3(1,1,-1);
-    b = Point3(-1,1,1);
-    c = Point3(1,1,1);
-    glBegin(GL_TRIANGLES);
-        //calculate m once per triangle
-        m = Vector3(a, c).cross(Vector3(b, c));
-
-        //s and v per vertices
-        s = Vector3(a, sunShine);
-        v = Vector3(a, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(a.x,a.y,a.z);
-
-        s = Vector3(b, sunShine);
-        v = Vector3(b, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(b.x,b.y,b.z);
-
-        s = Vector3(c, sunShine);
-        v = Vector3(c, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(c.x,c.y,c.z);
-    glEnd();
-    
+MetricSlot metricSlots[METRIC_SLOTS];
+atomic<int> metricThreads(0);
 
-    b = Point3(1,-1,1);
-    a = Point3(-1,1,1);
-    c = Point3(1,1,1);
-    glBegin(GL_TRIANGLES);
-        //calculate m once per triangle
-        m = Vector3(a, c).cross(Vector3(b, c));
-
-        //s and v per vertices
-        s = Vector3(a, sunShine);
-        v = Vector3(a, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(a.x,a.y,a.z);
-
-        s = Vector3(b, sunShine);
-        v = Vector3(b, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(b.x,b.y,b.z);
-
-        s = Vector3(c, sunShine);
-        v = Vector3(c, cam.eye);
-        Ir = light(s,m,v,Ia,Par,Id,Pdr,Is,Psr,f);
-        Ig = light(s,m,v,Ia,Pag,Id,Pdg,Is,Psg,f);
-        Ib = light(s,m,v,Ia,Pab,Id,Pdb,Is,Psb,f);
-        glColor3f(Ir,Ig,Ib);
-        glVertex3d(c.x,c.y,c.z);
-    glEnd();
-
-    //End Triangles
+//a thread owns its slot, so it can add without a locked instruction, only
+//the shared last slot needs a real atomic add
+inline void countMetric(int m, unsigned long long n)
+{
+    static thread_local int slot = min(metricThreads.fetch_add(1), METRIC_SLOTS - 1);
+    atomic<unsigned long long>& v = metricSlots[slot].value[m];
+    if (slot < METRIC_SLOTS - 1)
+        v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed);
+    else
+        v.fetch_add(n, memory_order_relaxed);
+}
 
-    
-    //draw sunshine
-    glPushMatrix();
-        //draw a line to the sunshine 
-        glBegin(GL_LINES);
-            glColor3f(1,1,.5);
-            glVertex3d(1,1,1);
-            glVertex3d(sunShine.x,sunShine.y,sunShine.z);   
-        glEnd();
+void countFrame(double ms)
+{
+    countMetric(METRIC_FRAMES, 1);
+    countMetric(METRIC_FRAME_MICROS, (unsigned long long)(ms * 1000));
+    int b = 0;
+    while (b < FRAME_BUCKETS && ms > frameBuckets[b] * 1000)
+        b++;
+    if (b < FRAME_BUCKETS)
+        countMetric(METRIC_FRAME_BUCKETS + b, 1);
+}
 
-        glTranslated(sunShine.x,sunShine.y,sunShine.z);
+//every counter summed over the slots, a read can land between two adds of
+//another thread but never sees half of one
+void sumMetrics(unsigned long long out[METRICS])
+{
+    for (int m = 0; m < METRICS; m++)
+        out[m] = 0;
+    for (int s = 0; s < METRIC_SLOTS; s++)
+        for (int m = 0; m < METRICS; m++)
+            out[m] += metricSlots[s].value[m].load(memory_order_relaxed);
+}
 
-        glColor3d(1,1,0);
-        glutSolidSphere(1,20,20);
+//the prometheus text exposition format, counters and one histogram
+string formatMetrics()
+{
+    const struct { int metric; const char* name; const char* help; } counters[] = {
+        { METRIC_TRIANGLES,    "light_triangles_submitted_total", "Triangles submitted to a renderer." },
+        { METRIC_CULLED,       "light_triangles_culled_total",    "Submitted triangles dropped before rasterizing." },
+        { METRIC_VERTICES,     "light_vertices_shaded_total",     "Vertices lit per vertex." },
+        { METRIC_PIXELS,       "light_pixels_shaded_total",       "Pixels rasterized and shaded." },
+        { METRIC_LIGHT_CALLS,  "light_light_calls_total",         "light() evaluations, one per sample and light." },
+        { METRIC_POW_CALLS,    "light_pow_calls_total",           "light() evaluations that worked out the phong pow." },
+        { METRIC_CACHE_HITS,   "light_diffuse_cache_hits_total",  "Vertices whose diffuse came from the cache." },
+        { METRIC_CACHE_MISSES, "light_diffuse_cache_misses_total","Vertices whose diffuse was lit again." }
+    };
+    unsigned long long v[METRICS];
+    sumMetrics(v);
+
+    string out;
+    char line[256];
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                 counters[i].name, counters[i].help, counters[i].name, counters[i].name, v[counters[i].metric]);
+        out += line;
+    }
 
-        glColor3f(0,0,0);
-        string str = "Sunshine";
-        glRasterPos3d(1, 1, 1);
-        for (int i = 0; i < 8; i++)
-            glutBitmapCharacter(GLUT_BITMAP_8_BY_13, (int)str[i]); 
+    out += "# HELP light_frame_seconds Time display took per frame.\n# TYPE light_frame_seconds histogram\n";
+    unsigned long long below = 0;
+    for (int b = 0; b < FRAME_BUCKETS; b++)
+    {
+        below += v[METRIC_FRAME_BUCKETS + b];
+        snprintf(line, sizeof(line), "light_frame_seconds_bucket{le=\"%g\"} %llu\n", frameBuckets[b], below);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "light_frame_seconds_bucket{le=\"+Inf\"} %llu\nlight_frame_seconds_sum %g\nlight_frame_seconds_count %llu\n",
+             v[METRIC_FRAMES], v[METRIC_FRAME_MICROS] / 1e6, v[METRIC_FRAMES]);
+    out += line;
+    return out;
+}
 
-        
-    glPopMatrix();
+//rewrites path every few seconds, through a temporary file and a rename so a
+//scraper never reads half a file
+class MetricsExporter
+{
+    public:
+        MetricsExporter() : running(false), quit(false), seconds(5) {}
+        ~MetricsExporter() { finish(); }
+
+        void start(const string& p, double every)
+        {
+            finish();
+            path = p;
+            seconds = every;
+            quit = false;
+            running = true;
+            worker = thread(&MetricsExporter::writer, this);
+        }
 
-    glFlush();
-    glutSwapBuffers();
+        //the writer makes one last write with everything counted so far and
+        //leaves, this doesn't wait for it
+        void stop()
+        {
+            if (!running)
+                return;
+            {
+                lock_guard<mutex> hold(lock);
+                quit = true;
+            }
+            wake.notify_one();
+            running = false;
+        }
+
+        //stop and wait for the last write
+        void finish()
+        {
+            stop();
+            if (worker.joinable())
+                worker.join();
+        }
+
+    private:
+        void writer()
+        {
+            unique_lock<mutex> hold(lock);
+            for (;;)
+            {
+                bool last = wake.wait_for(hold, chrono::duration<double>(seconds), [this] { return quit; });
+                hold.unlock();
+                write();
+                hold.lock();
+                if (last)
+                    return;
+            }
+        }
+
+        void write()
+        {
+            string text = formatMetrics(), temp = path + ".tmp";
+            FILE* f = fopen(temp.c_str(), "wb");
+            if (!f)
+                return;
+            bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+            ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+            remove(path.c_str());   //rename won't replace a file there
+#endif
+            if (!ok || rename(temp.c_str(), path.c_str()) != 0)
+                remove(temp.c_str());
+        }
+
+        thread worker;
+        mutex lock;
+        condition_variable wake;
+        bool running, quit;
+        string path;
+        double seconds;
+};
+
+MetricsExporter metrics;
+
+//meshes -------------------------------------------
+//geometry never moves, so normals are worked out once when a mesh is
+//built or loaded and kept next to the positions for the per-frame path
+
+struct MeshVertex
+{
+    Point3 p;
+    Vector3 n;      //area weighted average of the faces around it
+    float u, v;     //texture coordinates
+    Vector3 t;      //tangent along u, square to n
+    float handedness;   //+1 when the bitangent along v is n x t, -1 when it is t x n
+
+    MeshVertex() : u(0), v(0), handedness(1) {}
+};
 
+struct Mesh
+{
+    string name;
+    vector<MeshVertex> vert;
+    vector<int> index;          //three per triangle
+    vector<Vector3> faceNormal; //unit normal per triangle
+    Point3 lo, hi;              //bounding box
+    int material;               //into sceneMaterials, 0 is the cube's and 1 the other one unless a scene says otherwise
+    unsigned version;           //new every time the vertices are, keys what is cached for them
+
+    Mesh() : material(0), version(0) {}
+    int triangles() const { return (int)index.size() / 3; }
+};
+
+vector<Mesh> meshes;
+unsigned geometryVersion = 1;   //bump when the meshes change after the first frame
+unsigned geometryMoves = 0;     //bump when they only moved, the triangles stay the same
+unsigned meshVersions = 0;
+
+//every mesh passes through here whenever its vertices are made or moved, so
+//this is also where it gets a version nothing lit before has seen
+void buildBounds(Mesh& mesh)
+{
+    mesh.version = ++meshVersions;
+    mesh.lo = mesh.hi = mesh.vert.empty() ? Point3(0, 0, 0) : mesh.vert[0].p;
+    for (size_t i = 1; i < mesh.vert.size(); i++)
+    {
+        const Point3& p = mesh.vert[i].p;
+        mesh.lo = Point3(min(mesh.lo.x, p.x), min(mesh.lo.y, p.y), min(mesh.lo.z, p.z));
+        mesh.hi = Point3(max(mesh.hi.x, p.x), max(mesh.hi.y, p.y), max(mesh.hi.z, p.z));
+    }
 }
 
-void keyboardDrawPrompt(unsigned char key, int xmouse, int ymouse) {
-	switch(key)
-	{
-        //camera controls
-        case 'a':    cam.yaw(-2.0); break; 
-        case 'd':    cam.yaw(2.0); break;
-        
-        case 'w':    cam.pitch(-2.0); break;
-        case 's':    cam.pitch(2.0); break; 
-        
-        case 'q':    cam.roll(-2.0); break; 
-        case 'e':    cam.roll(2.0); break; 
+//nearest distance from p to a box, 0 inside it
+Real boxDistance(Point3 p, Point3 lo, Point3 hi)
+{
+    Real dx = max(max(lo.x - p.x, p.x - hi.x), (Real)0);
+    Real dy = max(max(lo.y - p.y, p.y - hi.y), (Real)0);
+    Real dz = max(max(lo.z - p.z, p.z - hi.z), (Real)0);
+    return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+//face normals and smooth vertex normals in two parallel passes, each worker
+//adds its faces into its own buffer and the buffers are summed per vertex,
+//the bounding box comes along since every mesh passes through here
+void buildNormals(Mesh& mesh)
+{
+    int tris = mesh.triangles(), verts = (int)mesh.vert.size();
+    int count = workers().size();
+    vector<vector<Vector3> > acc(count);
+    mesh.faceNormal.resize(tris);
+
+    parallelFor(tris, 4096, [&](int begin, int end, int w) {
+        vector<Vector3>& sum = acc[w];
+        if (sum.empty())
+            sum.resize(verts);
+
+        for (int t = begin; t < end; t++)
+        {
+            const int* i = &mesh.index[3 * t];
+            Point3 a = mesh.vert[i[0]].p, b = mesh.vert[i[1]].p, c = mesh.vert[i[2]].p;
+
+            //same m as the cube always used, its length is twice the triangle area
+            Vector3 m = Vector3(a, c).cross(Vector3(b, c));
+            sum[i[0]] += m;
+            sum[i[1]] += m;
+            sum[i[2]] += m;
+
+            Real len = m.magnitude();
+            mesh.faceNormal[t] = len > 0 ? m / len : Vector3(0, 1, 0);
+        }
+    });
+
+    parallelFor(verts, 4096, [&](int begin, int end, int) {
+        for (int v = begin; v < end; v++)
+        {
+            Vector3 n;
+            for (int w = 0; w < count; w++)
+                if (!acc[w].empty())
+                    n += acc[w][v];
+
+            Real len = n.magnitude();
+            mesh.vert[v].n = len > 0 ? n / len : Vector3(0, 1, 0);
+        }
+    });
+    buildBounds(mesh);
+}
 
-        case '\'':   cam.slide(0.0, .2, 0); break;
-        case '/':    cam.slide(0.0, -.2, 0); break;
+//texture coordinates for a mesh that came without any, each vertex is
+//projected along the axis its normal points most along, across the bounds
+void boxUVs(Mesh& mesh)
+{
+    for (size_t i = 0; i < mesh.vert.size(); i++)
+    {
+        MeshVertex& v = mesh.vert[i];
+        Real p[3] = { v.p.x, v.p.y, v.p.z }, lo[3] = { mesh.lo.x, mesh.lo.y, mesh.lo.z }, hi[3] = { mesh.hi.x, mesh.hi.y, mesh.hi.z };
+        Real n[3] = { fabs(v.n.x), fabs(v.n.y), fabs(v.n.z) };
+        int axis = n[0] >= n[1] && n[0] >= n[2] ? 0 : n[1] >= n[2] ? 1 : 2;
+        int a = (axis + 1) % 3, b = (axis + 2) % 3;
+        v.u = hi[a] > lo[a] ? (float)((p[a] - lo[a]) / (hi[a] - lo[a])) : 0;
+        v.v = hi[b] > lo[b] ? (float)((p[b] - lo[b]) / (hi[b] - lo[b])) : 0;
+    }
+}
 
-        //sunshine controlls
-        case 'u':    sunShine = Point3(sunShine.x, sunShine.y + 1, sunShine.z); break; 
-        case 'j':    sunShine = Point3(sunShine.x, sunShine.y - 1, sunShine.z); break; 
-        
-        case 'h':    sunShine = Point3(sunShine.x - 1, sunShine.y, sunShine.z); break; 
-        case 'k':    sunShine = Point3(sunShine.x + 1, sunShine.y, sunShine.z); break; 
+//tangents for normal maps once the texture coordinates are in, each triangle
+//adds the directions u and v grow along to its vertices from per worker
+//buffers like buildNormals, then the sums are made square to the normal
+void buildTangents(Mesh& mesh)
+{
+    int tris = mesh.triangles(), verts = (int)mesh.vert.size();
+    int count = workers().size();
+    vector<vector<Vector3> > acc(count);    //u then v direction, two per vertex
+
+    parallelFor(tris, 4096, [&](int begin, int end, int w) {
+        vector<Vector3>& sum = acc[w];
+        if (sum.empty())
+            sum.resize(2 * verts);
+
+        for (int t = begin; t < end; t++)
+        {
+            const int* i = &mesh.index[3 * t];
+            const MeshVertex &a = mesh.vert[i[0]], &b = mesh.vert[i[1]], &c = mesh.vert[i[2]];
+            Vector3 e1(a.p, b.p), e2(a.p, c.p);
+            float du1 = b.u - a.u, dv1 = b.v - a.v, du2 = c.u - a.u, dv2 = c.v - a.v;
+            float det = du1 * dv2 - du2 * dv1;
+            if (fabs(det) < 1e-12f)
+                continue;
+            Vector3 sdir = (e1 * dv2 - e2 * dv1) / det, tdir = (e2 * du1 - e1 * du2) / det;
+            for (int k = 0; k < 3; k++)
+            {
+                sum[2 * i[k]] += sdir;
+                sum[2 * i[k] + 1] += tdir;
+            }
+        }
+    });
+
+    parallelFor(verts, 4096, [&](int begin, int end, int) {
+        for (int v = begin; v < end; v++)
+        {
+            Vector3 s, t;
+            for (int w = 0; w < count; w++)
+                if (!acc[w].empty())
+                {
+                    s += acc[w][2 * v];
+                    t += acc[w][2 * v + 1];
+                }
+
+            MeshVertex& mv = mesh.vert[v];
+            Vector3 tangent = s - mv.n * mv.n.dot(s);
+            Real len = tangent.magnitude();
+            if (len <= 0)
+            {
+                //no uv to follow, any direction square to n does
+                tangent = fabs(mv.n.x) < .9 ? Vector3(1, 0, 0) : Vector3(0, 1, 0);
+                tangent = tangent - mv.n * mv.n.dot(tangent);
+                len = tangent.magnitude();
+            }
+            mv.t = tangent / len;
+            mv.handedness = mv.n.cross(mv.t).dot(t) < 0 ? -1.0f : 1.0f;
+        }
+    });
+}
 
-        //color controls
-        case 'c':    GS ? GS = false : GS = true; break; 
+//the cube keeps its hard edges, every triangle gets its own three vertices
+//so the smoothed normals come out equal to the face normals
+Mesh buildCube()
+{
+    //three points per triangle in the order they are drawn
+    const Real corners[][3] = {
+        { 1, 1,-1}, { 1,-1, 1}, { 1,-1,-1},
+        { 1,-1, 1}, {-1, 1, 1}, {-1,-1, 1},
+        {-1, 1, 1}, { 1, 1,-1}, {-1, 1,-1},
+        { 1,-1, 1}, { 1, 1,-1}, { 1, 1, 1},
+        { 1, 1,-1}, {-1, 1, 1}, { 1, 1, 1},
+        {-1, 1, 1}, { 1,-1, 1}, { 1, 1, 1}
+    };
+
+    Mesh mesh;
+    mesh.name = "cube";
+    int count = sizeof(corners) / sizeof(corners[0]);
+    for (int i = 0; i < count; i++)
+    {
+        MeshVertex v;
+        v.p = Point3(corners[i][0], corners[i][1], corners[i][2]);
+        mesh.vert.push_back(v);
+        mesh.index.push_back(i);
+    }
+    buildNormals(mesh);
+    boxUVs(mesh);
+    buildTangents(mesh);
+    return mesh;
+}
 
-        case 27 : exit(1);
-    
+//count more cubes stacked in a block behind the first one, seen from the start
+//position most of them are hidden, a deep scene for the occlusion culling
+void addCrowd(int count)
+{
+    Mesh cube = buildCube();
+    int side = 1;
+    while (side * side * side < count)
+        side++;
+    for (int i = 0; i < count; i++)
+    {
+        Mesh m = cube;
+        Real x = -3 - 3 * (i % side), y = -3 * ((i / side) % side), z = -3 - 3 * (i / (side * side));
+        for (size_t v = 0; v < m.vert.size(); v++)
+            m.vert[v].p = Point3(m.vert[v].p.x + x, m.vert[v].p.y + y, m.vert[v].p.z + z);
+        m.name = "crowd";
+        m.material = i % 2;
+        buildBounds(m);
+        meshes.push_back(m);
+    }
+}
+
+//wavefront obj, only v, vt and f lines are read, polygons are split into fans.
+//a vertex keeps the first texture coordinate a face gives it, without any
+//vt lines the mesh gets box projected ones
+bool loadOBJ(const char* path, Mesh& mesh)
+{
+    ifstream in(path);
+    if (!in)
+        return false;
+
+    mesh.name = path;
+    mesh.material = 1;
+    vector<float> uvs;
+    vector<char> hasUV;
+    string line;
+    while (getline(in, line))
+    {
+        const char* p = line.c_str();
+        if (p[0] == 'v' && p[1] == ' ')
+        {
+            MeshVertex v;
+            char* end;
+            v.p.x = (Real)strtod(p + 2, &end);
+            v.p.y = (Real)strtod(end, &end);
+            v.p.z = (Real)strtod(end, &end);
+            mesh.vert.push_back(v);
+            hasUV.push_back(0);
+        }
+        else if (p[0] == 'v' && p[1] == 't' && p[2] == ' ')
+        {
+            char* end;
+            uvs.push_back((float)strtod(p + 3, &end));
+            uvs.push_back((float)strtod(end, &end));
+        }
+        else if (p[0] == 'f' && p[1] == ' ')
+        {
+            //f 1 2 3, f 1/1/1 2/2/2 ..., negative numbers count back from the end
+            vector<int> face;
+            char* end;
+            p += 2;
+            for (;;)
+            {
+                long i = strtol(p, &end, 10);
+                if (end == p)
+                    break;
+                int vi = i < 0 ? (int)mesh.vert.size() + (int)i : (int)i - 1;
+                face.push_back(vi);
+                p = end;
+                if (*p == '/' && vi >= 0 && vi < (int)mesh.vert.size() && !hasUV[vi])
+                {
+                    long t = strtol(p + 1, &end, 10);
+                    int ti = t < 0 ? (int)uvs.size() / 2 + (int)t : (int)t - 1;
+                    if (end != p + 1 && ti >= 0 && 2 * ti + 1 < (int)uvs.size())
+                    {
+                        mesh.vert[vi].u = uvs[2 * ti];
+                        mesh.vert[vi].v = uvs[2 * ti + 1];
+                        hasUV[vi] = 1;
+                    }
+                }
+                while (*p && *p != ' ' && *p != '\t')
+                    p++;
+            }
+            for (size_t k = 2; k < face.size(); k++)
+            {
+                mesh.index.push_back(face[0]);
+                mesh.index.push_back(face[k - 1]);
+                mesh.index.push_back(face[k]);
+            }
+        }
     }
 
-    if(a == 360 || a == -360)
-        a = 0;
+    for (size_t i = 0; i < mesh.index.size(); i++)
+        if (mesh.index[i] < 0 || mesh.index[i] >= (int)mesh.vert.size())
+            return false;
+
+    buildNormals(mesh);
+    if (uvs.empty())
+        boxUVs(mesh);
+    buildTangents(mesh);
+    return true;
+}
+
+//materials ----------------------------------------
+//f is the specular exponent, Ia Id Is the light intensities
+//and Pa Pd Ps the r g b reflection coefficents
+template <typename T>
+struct MaterialT
+{
+    T f;
+    T Ia, Id, Is;
+    T Pa[3], Pd[3], Ps[3];
+};
+typedef MaterialT<Real> Material;
+
+Material brass  = { 27.8974, .5, .5, 100,
+                    { .329412, .223529, .027451 },
+                    { .780392, .568627, .113725 },
+                    { .992157, .941176, .807843 } };
+
+Material silver = { 51.2, .5, .5, 100,
+                    { .19225, .19225, .19225 },
+                    { .50754, .50754, .50754 },
+                    { .508273, .508273, .508273 } };
 
-    //call the redraw function
-    glutPostRedisplay();
+//what the meshes are drawn in, a scene file can change and add to these,
+//'c' swaps the first two
+vector<Material> sceneMaterials = { brass, silver };
+vector<string> materialNames = { "brass", "silver" };
 
+//a point light, the sun is always the first one in a frame's list
+struct PointLight
+{
+    Point3 pos;
+    Real scale;     //multiplies Id and Is of the material
+    Real radius;    //nothing past it is lit, 0 for a light that doesn't fall off
+};
+
+//windowed inverse square falloff with distance in units of the radius, it
+//reaches 0 at the radius so everything past it can be skipped
+inline Real attenuation(const PointLight& l, const Vector3& s)
+{
+    if (l.radius <= 0)
+        return 1;
+    Real x = s.lengthSquared() / (l.radius * l.radius);
+    if (x >= 1)
+        return 0;
+    Real w = 1 - x * x;
+    return w * w / (1 + x);
 }
 
-void SpecialKeys(int key, int x, int y)
+inline bool inRange(const PointLight& l, Point3 p)
 {
-    switch (key)
+    return l.radius <= 0 || Vector3(p, l.pos).lengthSquared() < l.radius * l.radius;
+}
+
+//extra lights from the command line, the quality controller may use fewer
+vector<PointLight> fillLights;
+Real lightRadius = 0;   //what the sun and the fill lights are made with
+
+//brdf tables --------------------------------------
+//lambert and phong baked at startup per specular exponent over N.L and N.H,
+//shading then gets both from one bilinear fetch instead of working out the pow
+
+const int BRDF_NL = 16;     //lambert is linear in N.L, a few columns already bilerp it exactly
+const int BRDF_NH = 256;    //the specular lobe is what needs the resolution
+
+struct BRDFTable
+{
+    Real f;                             //exponent it was baked for
+    float texel[BRDF_NH][BRDF_NL][2];   //lambert, phong
+};
+
+bool brdfLookup = false;
+vector<BRDFTable> brdfTables;   //filled before the first frame, read only after
+
+//the table for a material, 0 when lookups are off or nothing was baked for it
+const BRDFTable* findBRDF(const Material& mat)
+{
+    if (!brdfLookup)
+        return 0;
+    for (size_t i = 0; i < brdfTables.size(); i++)
+        if (brdfTables[i].f == mat.f)
+            return &brdfTables[i];
+    return 0;
+}
+
+//sample the model itself on the grid, unit vectors in the xz plane with the
+//normal on z give lambert N.L, and phong with s = v gives N.H
+void bakeBRDF(const Material& mat)
+{
+    for (size_t i = 0; i < brdfTables.size(); i++)
+        if (brdfTables[i].f == mat.f)
+            return;
+
+    brdfTables.push_back(BRDFTable());
+    BRDFTable& t = brdfTables.back();
+    t.f = mat.f;
+    Vector3 m(0, 0, 1);
+    for (int y = 0; y < BRDF_NH; y++)
     {
-        //camera controls
-        case GLUT_KEY_LEFT:  if(spin) a -= 10; cam.slide(-0.2, 0, 0); break;
-        case GLUT_KEY_UP:    if(spin) a += 10; cam.slide(0, 0, -0.2); break; 
-        case GLUT_KEY_RIGHT: if(spin) a += 10; cam.slide(0.2, 0, 0);  break;
-        case GLUT_KEY_DOWN:  if(spin) a -= 10; cam.slide(0, 0, 0.2);  break;  
+        Real ndh = (Real)y / (BRDF_NH - 1);
+        Vector3 h(sqrt(max((Real)0, 1 - ndh * ndh)), 0, ndh);
+        float spec = (float)phong(h, h, m, mat.f);
+        for (int x = 0; x < BRDF_NL; x++)
+        {
+            Real ndl = (Real)x / (BRDF_NL - 1);
+            t.texel[y][x][0] = (float)lambert(Vector3(sqrt(max((Real)0, 1 - ndl * ndl)), 0, ndl), m);
+            t.texel[y][x][1] = spec;
+        }
+    }
+}
+
+//lambert and phong for s, v and m from the table, the same cosines the
+//analytic versions take, negative ones land on the zero edge
+inline void fetchBRDF(const BRDFTable& t, const Vector3& s, const Vector3& v, const Vector3& m, Real& d, Real& sp)
+{
+    Vector3 h = s + v;
+    Real mm = m.lengthSquared();
+    float x = min(max((float)(s.dot(m) / sqrt(s.lengthSquared() * mm)), 0.0f), 1.0f) * (BRDF_NL - 1);
+    float y = min(max((float)(h.dot(m) / sqrt(h.lengthSquared() * mm)), 0.0f), 1.0f) * (BRDF_NH - 1);
+    int x0 = min((int)x, BRDF_NL - 2), y0 = min((int)y, BRDF_NH - 2);
+    float fx = x - x0, fy = y - y0;
+
+    const float *a = t.texel[y0][x0], *b = t.texel[y0 + 1][x0];
+    float out[2];
+    for (int k = 0; k < 2; k++)
+    {
+        float lo = a[k] + (a[k + 2] - a[k]) * fx, hi = b[k] + (b[k + 2] - b[k]) * fx;
+        out[k] = lo + (hi - lo) * fy;
     }
-    glutPostRedisplay();
+    d = out[0];
+    sp = out[1];
 }
 
+//light() for r, g and b summed over a list of lights, lambert and phong only
+//depend on the vectors so they are worked out once for all three channels,
+//ambient scales Ia per channel when environment lighting is on
+void shadePoint(Point3 p, Vector3 m, Point3 eye, const Material& mat,
+                const PointLight* lights, int count, const float* ambient, float rgba[4])
+{
+    Vector3 v(p, eye);
+    Real d = 0, sp = 0;
+    const BRDFTable* table = findBRDF(mat);
+    for (int i = 0; i < count; i++)
+    {
+        //s per light, out of range lights stop before anything is normalized
+        Vector3 s(p, lights[i].pos);
+        Real k = lights[i].scale * attenuation(lights[i], s);
+        if (k == 0)
+            continue;
+        if (table)
+        {
+            Real ld, ls;
+            fetchBRDF(*table, s, v, m, ld, ls);
+            d  += k * ld;
+            sp += k * ls;
+            continue;
+        }
+        d  += k * lambert(s, m);
+        sp += k * phong(v, s, m, mat.f);
+    }
+    d *= mat.Id;
+    sp *= mat.Is;
+
+    for (int i = 0; i < 3; i++)
+    {
+        Real a = ambient ? mat.Ia * ambient[i] : mat.Ia;
+        rgba[i] = (float)(a * mat.Pa[i] + d * mat.Pd[i] + sp * mat.Ps[i]);
+    }
+    rgba[3] = 1;
+}
+
+//shadePoint in two halves for vertices that keep the half that doesn't
+//depend on the eye, ambient and diffuse into rgb. lambert is cheap and gets
+//cached anyway, only the specular half looks at the brdf table
+void shadeDiffuse(Point3 p, Vector3 m, const Material& mat,
+                  const PointLight* lights, int count, const float* ambient, float rgb[3])
+{
+    Real d = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Vector3 s(p, lights[i].pos);
+        Real k = lights[i].scale * attenuation(lights[i], s);
+        if (k != 0)
+            d += k * lambert(s, m);
+    }
+    d *= mat.Id;
+
+    for (int i = 0; i < 3; i++)
+    {
+        Real a = ambient ? mat.Ia * ambient[i] : mat.Ia;
+        rgb[i] = (float)(a * mat.Pa[i] + d * mat.Pd[i]);
+    }
+}
+
+//and the specular half added on top
+void addSpecular(Point3 p, Vector3 m, Point3 eye, const Material& mat,
+                 const PointLight* lights, int count, float rgb[3])
+{
+    Vector3 v(p, eye);
+    Real sp = 0;
+    const BRDFTable* table = findBRDF(mat);
+    for (int i = 0; i < count; i++)
+    {
+        Vector3 s(p, lights[i].pos);
+        Real k = lights[i].scale * attenuation(lights[i], s);
+        if (k == 0)
+            continue;
+        if (table)
+        {
+            Real ld, ls;
+            fetchBRDF(*table, s, v, m, ld, ls);
+            sp += k * ls;
+        }
+        else
+            sp += k * phong(v, s, m, mat.f);
+    }
+    sp *= mat.Is;
+
+    for (int i = 0; i < 3; i++)
+        rgb[i] += (float)(sp * mat.Ps[i]);
+}
+
+//best time in ms of a few rounds of each of two ways to do the same work,
+//run(way) does one round. the two ways take turns so they see the same machine
+void bestOfTwo(const function<void(int)>& run, double best[2])
+{
+    best[0] = best[1] = 1e30;
+    for (int round = 0; round < 5; round++)
+        for (int way = 0; way < 2; way++)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            run(way);
+            best[way] = min(best[way], chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+}
+
+//the tables against lambert and phong on random vectors like precisionCheck,
+//then shadePoint timed with four lights both ways
+int brdfCheck(int samples)
+{
+    const Material* mats[2] = { &brass, &silver };
+    const char* names[2] = { "brass ", "silver" };
+    bool was = brdfLookup;
+    brdfLookup = true;
+    for (int mi = 0; mi < 2; mi++)
+    {
+        const Material& mat = *mats[mi];
+        bakeBRDF(mat);
+        const BRDFTable& t = *findBRDF(mat);
+
+        srand(1);
+        double worst[2] = { 0, 0 }, total[2] = { 0, 0 };
+        int n = 0;
+        for (int i = 0; i < samples; i++)
+        {
+            Real r[9];
+            for (int k = 0; k < 9; k++)
+                r[k] = (Real)(20.0 * rand() / RAND_MAX - 10.0);
+            Vector3 s(r[0], r[1], r[2]), m(r[3], r[4], r[5]), v(r[6], r[7], r[8]);
+            if (m.magnitude() < 1e-3 || s.magnitude() < 1e-3 || (s + v).magnitude() < 1e-3)
+                continue;
+
+            Real ld, ls;
+            fetchBRDF(t, s, v, m, ld, ls);
+            double err[2] = { fabs(ld - lambert(s, m)), fabs(ls - phong(v, s, m, mat.f)) };
+            for (int k = 0; k < 2; k++)
+            {
+                worst[k] = max(worst[k], err[k]);
+                total[k] += err[k];
+            }
+            n++;
+        }
+        cout << "brdf table " << names[mi] << " f " << mat.f << ": lambert error max " << worst[0] << " mean " << total[0] / n
+             << ", phong error max " << worst[1] << " mean " << total[1] / n << "\n";
+    }
+
+    PointLight lights[4];
+    for (int i = 0; i < 4; i++)
+    {
+        PointLight l = { Point3(10 * cos(i * 1.5), 8, 10 * sin(i * 1.5)), 1, 0 };
+        lights[i] = l;
+    }
+    vector<Point3> ps(samples);
+    vector<Vector3> ms(samples);
+    srand(2);
+    for (int i = 0; i < samples; i++)
+    {
+        ps[i] = Point3(2.0f * rand() / RAND_MAX - 1, 2.0f * rand() / RAND_MAX - 1, 1);
+        ms[i] = Vector3(.3f * rand() / RAND_MAX, .3f * rand() / RAND_MAX, 1);
+        ms[i].normalize();
+    }
+    double best[2];
+    float sum[2];
+    bestOfTwo([&](int table) {
+        brdfLookup = table != 0;
+        sum[table] = 0;
+        for (int i = 0; i < samples; i++)
+        {
+            float rgba[4];
+            shadePoint(ps[i], ms[i], Point3(3, 3, 3), *mats[i & 1], lights, 4, 0, rgba);
+            sum[table] += rgba[0];
+        }
+    }, best);
+    for (int table = 0; table < 2; table++)
+        cout << "shadePoint x4 lights " << (table ? "tables  " : "analytic") << ": "
+             << samples / best[table] / 1000 << " M samples/s (checksum " << sum[table] << ")\n";
+    brdfLookup = was;
+    return 0;
+}
+
+//shading kernels ----------------------------------
+//shadePoint and its two halves compiled once for every combination of what
+//they otherwise decide per call and per light: which terms, one light or a
+//list, whether there is a specular lobe and where it comes from, and whether
+//lights fall off. a batch picks its kernels once, the light loop then has no
+//test left in it but the falloff's early out. the results are the same bits
+//as the generic functions give
+
+enum ShadeTerms { TERMS_FULL, TERMS_DIFFUSE, TERMS_SPECULAR };     //shadePoint, shadeDiffuse, addSpecular
+enum LightClass { LIGHTS_ONE, LIGHTS_MANY };
+enum MaterialClass { MATERIAL_MATTE, MATERIAL_PHONG, MATERIAL_TABLE };
+
+//out is rgba for the full term, rgb for the halves, the specular half adds to it
+typedef void (*ShadeKernel)(Point3 p, Vector3 m, Point3 eye, const Material& mat, const BRDFTable* table,
+                            const PointLight* lights, int count, const float* ambient, float* out);
+
+bool specializedShading = true;
+
+template <int Terms, int Lights, int Model, bool Falloff>
+void shadeKernel(Point3 p, Vector3 m, Point3 eye, const Material& mat, const BRDFTable* table,
+                 const PointLight* lights, int count, const float* ambient, float* out)
+{
+    const bool diffuse = Terms != TERMS_SPECULAR;
+    const bool specular = Terms != TERMS_DIFFUSE && Model != MATERIAL_MATTE;
+    //shadeDiffuse never reads the table, shadePoint takes its lambert from it too
+    const bool fetch = Model == MATERIAL_TABLE && Terms != TERMS_DIFFUSE;
+
+    Vector3 v = specular ? Vector3(p, eye) : Vector3();
+    Real d = 0, sp = 0;
+    int n = Lights == LIGHTS_ONE ? 1 : count;
+    for (int i = 0; i < n; i++)
+    {
+        Vector3 s(p, lights[i].pos);
+        Real k = lights[i].scale;
+        if (Falloff)
+        {
+            k *= attenuation(lights[i], s);
+            if (k == 0)
+                continue;
+        }
+        if (fetch)
+        {
+            Real ld, ls;
+            fetchBRDF(*table, s, v, m, ld, ls);
+            d  += k * ld;
+            sp += k * ls;
+            continue;
+        }
+        if (diffuse)
+            d  += k * lambert(s, m);
+        if (specular)
+            sp += k * phong(v, s, m, mat.f);
+    }
+
+    sp *= mat.Is;
+    if (Terms == TERMS_SPECULAR)
+    {
+        if (specular)
+            for (int i = 0; i < 3; i++)
+                out[i] += (float)(sp * mat.Ps[i]);
+        return;
+    }
+
+    d *= mat.Id;
+    for (int i = 0; i < 3; i++)
+    {
+        Real a = ambient ? mat.Ia * ambient[i] : mat.Ia;
+        Real c = a * mat.Pa[i] + d * mat.Pd[i];
+        if (specular)
+            c += sp * mat.Ps[i];
+        out[i] = (float)c;
+    }
+    if (Terms == TERMS_FULL)
+        out[3] = 1;
+}
+
+//the generic functions behind the same signature, for when specializing is off
+template <int Terms>
+void genericKernel(Point3 p, Vector3 m, Point3 eye, const Material& mat, const BRDFTable*,
+                   const PointLight* lights, int count, const float* ambient, float* out)
+{
+    if (Terms == TERMS_FULL)
+        shadePoint(p, m, eye, mat, lights, count, ambient, out);
+    else if (Terms == TERMS_DIFFUSE)
+        shadeDiffuse(p, m, mat, lights, count, ambient, out);
+    else
+        addSpecular(p, m, eye, mat, lights, count, out);
+}
+
+//every instance, indexed terms, light class, material class, falloff
+struct KernelTable
+{
+    ShadeKernel k[3][2][3][2];
+
+    KernelTable()
+    {
+        fillTerms<TERMS_FULL>();
+        fillTerms<TERMS_DIFFUSE>();
+        fillTerms<TERMS_SPECULAR>();
+    }
+
+    template <int T> void fillTerms()
+    {
+        fillLights<T, LIGHTS_ONE>();
+        fillLights<T, LIGHTS_MANY>();
+    }
+    template <int T, int L> void fillLights()
+    {
+        fillModel<T, L, MATERIAL_MATTE>();
+        fillModel<T, L, MATERIAL_PHONG>();
+        fillModel<T, L, MATERIAL_TABLE>();
+    }
+    template <int T, int L, int M> void fillModel()
+    {
+        k[T][L][M][0] = &shadeKernel<T, L, M, false>;
+        k[T][L][M][1] = &shadeKernel<T, L, M, true>;
+    }
+};
+
+const KernelTable kernelTable;
+
+//a picked kernel with the table it was picked for
+struct LightingKernel
+{
+    ShadeKernel run;
+    const BRDFTable* table;
+    bool pow;               //whether it works out phong's pow, for the metrics
+
+    void operator()(Point3 p, const Vector3& m, Point3 eye, const Material& mat,
+                    const PointLight* lights, int count, const float* ambient, float* out) const
+    {
+        run(p, m, eye, mat, table, lights, count, ambient, out);
+    }
+};
+
+//no specular highlight, the matte kernels leave out phong's pow
+inline bool matteMaterial(const Material& mat)
+{
+    return mat.Is == 0 || (mat.Ps[0] == 0 && mat.Ps[1] == 0 && mat.Ps[2] == 0);
+}
+
+//the kernel for shading mat under these lights, called once per batch or part
+LightingKernel pickKernel(ShadeTerms terms, const Material& mat, const PointLight* lights, int count)
+{
+    const BRDFTable* table = findBRDF(mat);
+    if (!specializedShading)
+    {
+        ShadeKernel generic[3] = { &genericKernel<TERMS_FULL>, &genericKernel<TERMS_DIFFUSE>, &genericKernel<TERMS_SPECULAR> };
+        LightingKernel k = { generic[terms], table, !table && terms != TERMS_DIFFUSE };
+        return k;
+    }
+
+    int model = table ? MATERIAL_TABLE : matteMaterial(mat) ? MATERIAL_MATTE : MATERIAL_PHONG;
+    bool falloff = false;
+    for (int i = 0; i < count; i++)
+        falloff = falloff || lights[i].radius > 0;
+    LightingKernel k = { kernelTable.k[terms][count == 1 ? LIGHTS_ONE : LIGHTS_MANY][model][falloff], table,
+                         model == MATERIAL_PHONG && terms != TERMS_DIFFUSE };
+    return k;
+}
+
+//each kernel class against the generic function it stands in for, the full
+//term timed and all three checked for the same result
+int benchKernels(int samples)
+{
+    vector<Point3> ps(samples);
+    vector<Vector3> ms(samples);
+    srand(3);
+    for (int i = 0; i < samples; i++)
+    {
+        ps[i] = Point3(2.0f * rand() / RAND_MAX - 1, 2.0f * rand() / RAND_MAX - 1, 1);
+        ms[i] = Vector3(.3f * rand() / RAND_MAX, .3f * rand() / RAND_MAX, 1);
+        ms[i].normalize();
+    }
+    PointLight lights[8];
+    Material matte = brass;
+    matte.Is = 0;
+    const Material* mats[3] = { &matte, &brass, &brass };
+    const char* models[3] = { "matte", "phong", "table" };
+    bool was[2] = { brdfLookup, specializedShading };
+    bakeBRDF(brass);
+
+    int differ = 0;
+    for (int lightCount = 1; lightCount <= 8; lightCount += 7)
+        for (int falloff = 0; falloff < 2; falloff++)
+            for (int model = 0; model < 3; model++)
+            {
+                for (int i = 0; i < lightCount; i++)
+                {
+                    PointLight l = { Point3(10 * cos(i * .8), 8, 10 * sin(i * .8)), 1, falloff ? (Real)20 : 0 };
+                    lights[i] = l;
+                }
+                const Material& mat = *mats[model];
+                brdfLookup = model == MATERIAL_TABLE;
+
+                double best[2];
+                float sum[2];
+                bestOfTwo([&](int special) {
+                    specializedShading = special != 0;
+                    LightingKernel k = pickKernel(TERMS_FULL, mat, lights, lightCount);
+                    sum[special] = 0;
+                    for (int i = 0; i < samples; i++)
+                    {
+                        float rgba[4];
+                        k(ps[i], ms[i], Point3(3, 3, 3), mat, lights, lightCount, 0, rgba);
+                        sum[special] += rgba[0];
+                    }
+                }, best);
+
+                //every term of both ways on the same samples, any difference at all counts
+                for (int terms = TERMS_FULL; terms <= TERMS_SPECULAR; terms++)
+                {
+                    specializedShading = false;
+                    LightingKernel generic = pickKernel((ShadeTerms)terms, mat, lights, lightCount);
+                    specializedShading = true;
+                    LightingKernel special = pickKernel((ShadeTerms)terms, mat, lights, lightCount);
+                    for (int i = 0; i < samples; i += 7)
+                    {
+                        float a[4] = { .5f, .5f, .5f, 1 }, b[4] = { .5f, .5f, .5f, 1 };
+                        generic(ps[i], ms[i], Point3(3, 3, 3), mat, lights, lightCount, 0, a);
+                        special(ps[i], ms[i], Point3(3, 3, 3), mat, lights, lightCount, 0, b);
+                        differ += memcmp(a, b, sizeof(a)) != 0;
+                    }
+                }
+
+                cout << lightCount << (lightCount == 1 ? " light,  " : " lights, ") << (falloff ? "falloff, " : "no falloff, ") << models[model]
+                     << ": generic " << samples / best[0] / 1000 << ", specialized " << samples / best[1] / 1000
+                     << " M samples/s, " << best[0] / best[1] << "x\n";
+            }
+
+    cout << (differ ? "FAIL: " : "PASS: ") << differ << " samples differ from the generic path\n";
+    brdfLookup = was[0];
+    specializedShading = was[1];
+    return differ ? 1 : 0;
+}
+
+//read a binary ppm back, rows come out bottom first like the framebuffer
+bool readPPM(const char* path, int& w, int& h, vector<unsigned char>& rgb)
+{
+    ifstream in(path, ios::binary);
+    string magic;
+    int maxval;
+    if (!(in >> magic >> w >> h >> maxval) || magic != "P6" || maxval != 255 || w <= 0 || h <= 0)
+        return false;
+    in.get();
+
+    rgb.resize(3 * w * h);
+    for (int y = h - 1; y >= 0; y--)
+        in.read((char*)&rgb[3 * y * w], 3 * w);
+    return (bool)in;
+}
+
+//environment lighting -----------------------------
+//the environment map is projected once into 9 spherical harmonic coefficients
+//per channel, after that the ambient term is a small polynomial in the normal
+
+bool envLighting = false;
+
+//equirectangular radiance, row 0 looks straight up, bump version when it changes
+struct EnvironmentMap
+{
+    int w, h;
+    vector<float> rgb;
+    unsigned version;
+
+    EnvironmentMap() : w(0), h(0), version(0) {}
+};
+
+//irradiance coefficients, already convolved with the cosine lobe and divided by pi
+//so a white environment of radiance 1 gives the old constant ambient
+struct SHLighting
+{
+    float c[9][3];
+    unsigned version;   //environment version they were projected from
+
+    SHLighting() : version(0) {}
+};
+
+EnvironmentMap environment;
+SHLighting envSH;
+
+//real sh basis up to band 2 for a unit direction
+template <typename T>
+void shBasis(T x, T y, T z, T out[9])
+{
+    out[0] = T(.282095);
+    out[1] = T(.488603) * y;
+    out[2] = T(.488603) * z;
+    out[3] = T(.488603) * x;
+    out[4] = T(1.092548) * x * y;
+    out[5] = T(1.092548) * y * z;
+    out[6] = T(.315392) * (3 * z * z - 1);
+    out[7] = T(1.092548) * x * z;
+    out[8] = T(.546274) * (x * x - y * y);
+}
+
+//soft sky used until an environment is loaded, brighter toward the zenith and dark ground
+void makeSkyEnvironment(EnvironmentMap& env)
+{
+    const float zenith[3] = { .7f, .85f, 1.3f }, horizon[3] = { 1.2f, 1.15f, 1.05f }, ground[3] = { .5f, .42f, .35f };
+
+    env.w = 128;
+    env.h = 64;
+    env.rgb.resize(3 * env.w * env.h);
+    for (int j = 0; j < env.h; j++)
+    {
+        float up = cos(3.14159265f * (j + .5f) / env.h);
+        const float* far = up > 0 ? zenith : ground;
+        float t = up > 0 ? up : min(1.0f, -4 * up);
+        for (int i = 0; i < env.w; i++)
+            for (int k = 0; k < 3; k++)
+                env.rgb[3 * (j * env.w + i) + k] = horizon[k] + (far[k] - horizon[k]) * t;
+    }
+    env.version++;
+}
+
+bool loadEnvironment(const char* path, EnvironmentMap& env)
+{
+    vector<unsigned char> bytes;
+    if (!readPPM(path, env.w, env.h, bytes))
+        return false;
+
+    //readPPM hands back the bottom row first, the map wants the sky on row 0
+    env.rgb.resize(bytes.size());
+    for (int j = 0; j < env.h; j++)
+        for (int i = 0; i < 3 * env.w; i++)
+            env.rgb[3 * j * env.w + i] = bytes[3 * (env.h - 1 - j) * env.w + i] / 255.0f;
+    env.version++;
+    return true;
+}
+
+//integrate the map against the basis, rows are split across the pool and
+//every worker sums into its own coefficients before they are added up
+void projectEnvironment(const EnvironmentMap& env, SHLighting& sh)
+{
+    const double PI = 3.14159265358979;
+    int count = workers().size();
+    vector<double> partial(count * 27, 0.0);
+
+    parallelFor(env.h, 4, [&](int begin, int end, int w) {
+        double* sum = &partial[27 * w];
+        for (int j = begin; j < end; j++)
+        {
+            double theta = PI * (j + .5) / env.h;
+            double dw = (2 * PI / env.w) * (PI / env.h) * sin(theta);
+            for (int i = 0; i < env.w; i++)
+            {
+                double phi = 2 * PI * (i + .5) / env.w;
+                double y[9];
+                shBasis(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi), y);
+
+                const float* L = &env.rgb[3 * (j * env.w + i)];
+                for (int b = 0; b < 9; b++)
+                    for (int k = 0; k < 3; k++)
+                        sum[3 * b + k] += L[k] * y[b] * dw;
+            }
+        }
+    });
+
+    //cosine lobe per band is pi, 2pi/3 and pi/4, then divide by pi
+    const double band[9] = { 1, 2.0 / 3, 2.0 / 3, 2.0 / 3, .25, .25, .25, .25, .25 };
+    for (int b = 0; b < 9; b++)
+        for (int k = 0; k < 3; k++)
+        {
+            double total = 0;
+            for (int w = 0; w < count; w++)
+                total += partial[27 * w + 3 * b + k];
+            sh.c[b][k] = (float)(total * band[b]);
+        }
+    sh.version = env.version;
+}
+
+//reproject only when the environment changed since the last time
+void updateEnvironment()
+{
+    if (!envLighting || envSH.version == environment.version)
+        return;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    projectEnvironment(environment, envSH);
+    cout << "environment projected to sh in "
+         << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms\n";
+}
+
+//per channel ambient scale for a unit normal, 0 when environment lighting is off
+const float* ambientLight(const Vector3& n, float out[3])
+{
+    if (!envLighting)
+        return 0;
+
+    float y[9];
+    shBasis((float)n.x, (float)n.y, (float)n.z, y);
+    for (int k = 0; k < 3; k++)
+    {
+        float e = 0;
+        for (int b = 0; b < 9; b++)
+            e += envSH.c[b][k] * y[b];
+        out[k] = max(0.0f, e);
+    }
+    return out;
+}
+
+//output stage -------------------------------------
+//the lighting gives unclamped float colors, the framebuffer is 8 bits a channel,
+//so colors leave the shading path packed as rgba8 (r in the lowest byte)
+
+//16 bit position, w only pads it to 8 bytes so it stays aligned
+struct QuantPos
+{
+    short x, y, z, w;
+};
+
+//center and step size that turn a QuantPos back into world space
+struct QuantFrame
+{
+    Real cx, cy, cz, scale;
+};
+
+//the vertices and indices one mesh added to a batch
+struct BatchPart
+{
+    int mesh;
+    unsigned first, count;              //vertices
+    unsigned firstIndex, indexCount;
+};
+
+//ambient plus diffuse per vertex, kept over frames until the lights, the
+//materials or the environment change, or the part's own mesh does. a part
+//whose stamp is current only needs its specular term again when the camera moves
+struct DiffuseCache
+{
+    vector<float> rgb;              //per batch vertex
+    vector<unsigned> partStamp;     //stamp each part's rgb was lit under
+    vector<unsigned> partMesh;      //the mesh version it was lit for
+    vector<unsigned> partFirst;     //and where in the batch its vertices were
+    unsigned stamp;
+
+    //what the current stamp was lit with
+    unsigned environment;
+    bool env, brdf;
+    vector<PointLight> lights;
+    vector<Material> materials;
+
+    long long hits, misses;         //vertices, since the last report
+
+    DiffuseCache() : stamp(1), environment(0), env(false), brdf(false), hits(0), misses(0) {}
+};
+
+bool diffuseCaching = true;
+
+//shaded vertices of one frame, index holds three per triangle in the order they are drawn
+struct ShadedBatch
+{
+    vector<Point3> pos;        //world position per vertex
+    vector<float> color;       //unclamped rgba per vertex straight from the lighting
+    vector<unsigned> packed;   //rgba8 per vertex from the output stage
+    vector<QuantPos> qpos;     //16 bit positions, only filled when quantizing
+    vector<unsigned> index;
+    QuantFrame frame;
+
+    //what per pixel shading needs to light the same batch in the rasterizer
+    vector<Vector3> normal;
+    vector<float> uv;          //texture u v per vertex
+    vector<Vector3> tangent;   //along u, for normal maps
+    vector<float> handedness;  //+-1, which way the bitangent points
+    vector<PointLight> lights;
+    vector<Material> materials;
+    vector<unsigned char> materialId;  //per vertex, into materials
+    vector<LightingKernel> kernels;    //per material, shadePoint for all of lights
+    Point3 eye;
+    vector<BatchPart> parts;
+    DiffuseCache cache;         //outlives clear, it is what carries over between frames
+
+    void clear() { pos.clear(); color.clear(); packed.clear(); qpos.clear(); index.clear(); normal.clear(); uv.clear(); tangent.clear(); handedness.clear(); materialId.clear(); parts.clear(); }
+    int size() const { return (int)pos.size(); }
+};
+
+bool quantizePositions = false;
+
+unsigned packColor(const float rgba[4])
+{
+    unsigned out = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        //rounded to nearest even like cvtps in packColors, NaN fails the test and is 0
+        float c = rgba[i] * 255;
+        c = c > 0 ? min(c, 255.0f) : 0;
+        out |= (unsigned)lrintf(c) << (8 * i);
+    }
+    return out;
+}
+
+void unpackColor(unsigned c, float rgba[4])
+{
+    for (int i = 0; i < 4; i++)
+        rgba[i] = ((c >> (8 * i)) & 255) * (1.0f / 255);
+}
+
+//clamp and pack count rgba colors, four at a time with saturating packs when we have sse2
+void packColors(const float* rgba, int count, unsigned* out)
+{
+    int i = 0;
+#ifdef LIGHT_SSE2
+    const __m128 full = _mm_set1_ps(255.0f);
+    for (; i + 4 <= count; i += 4)
+    {
+        const float* p = rgba + 4 * i;
+        //min first so huge hdr values can't overflow the int conversion, a NaN
+        //comes through it, converts to INT_MIN and packs to 0
+        __m128i c0 = _mm_cvtps_epi32(_mm_min_ps(full, _mm_mul_ps(_mm_loadu_ps(p),      full)));
+        __m128i c1 = _mm_cvtps_epi32(_mm_min_ps(full, _mm_mul_ps(_mm_loadu_ps(p + 4),  full)));
+        __m128i c2 = _mm_cvtps_epi32(_mm_min_ps(full, _mm_mul_ps(_mm_loadu_ps(p + 8),  full)));
+        __m128i c3 = _mm_cvtps_epi32(_mm_min_ps(full, _mm_mul_ps(_mm_loadu_ps(p + 12), full)));
+
+        //32 -> 16 -> 8 bits, the unsigned pack clamps negatives to 0
+        __m128i lo = _mm_packs_epi32(c0, c1);
+        __m128i hi = _mm_packs_epi32(c2, c3);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = packColor(rgba + 4 * i);
+}
+
+//fit the batch bounds into +-32767 steps around their center
+void quantize(const vector<Point3>& pos, vector<QuantPos>& out, QuantFrame& frame)
+{
+    out.resize(pos.size());
+    if (pos.empty())
+        return;
+
+    Point3 lo = pos[0], hi = pos[0];
+    for (size_t i = 1; i < pos.size(); i++)
+    {
+        lo.x = min(lo.x, pos[i].x); hi.x = max(hi.x, pos[i].x);
+        lo.y = min(lo.y, pos[i].y); hi.y = max(hi.y, pos[i].y);
+        lo.z = min(lo.z, pos[i].z); hi.z = max(hi.z, pos[i].z);
+    }
+
+    frame.cx = (lo.x + hi.x) / 2;
+    frame.cy = (lo.y + hi.y) / 2;
+    frame.cz = (lo.z + hi.z) / 2;
+    Real extent = max(hi.x - lo.x, max(hi.y - lo.y, hi.z - lo.z)) / 2;
+    frame.scale = extent > 0 ? extent / 32767 : 1;
+
+    Real inv = 1 / frame.scale;
+    for (size_t i = 0; i < pos.size(); i++)
+    {
+        out[i].x = (short)floor((pos[i].x - frame.cx) * inv + .5);
+        out[i].y = (short)floor((pos[i].y - frame.cy) * inv + .5);
+        out[i].z = (short)floor((pos[i].z - frame.cz) * inv + .5);
+        out[i].w = 0;
+    }
+}
+
+Point3 dequantize(const QuantPos& q, const QuantFrame& frame)
+{
+    return Point3(frame.cx + q.x * frame.scale, frame.cy + q.y * frame.scale, frame.cz + q.z * frame.scale);
+}
+
+//run the output stage over everything that was shaded this frame
+void finishBatch(ShadedBatch& batch)
+{
+    batch.packed.resize(batch.size());
+    if (batch.size())
+        packColors(&batch.color[0], batch.size(), &batch.packed[0]);
+    if (quantizePositions)
+        quantize(batch.pos, batch.qpos, batch.frame);
+}
+
+//bytes a vertex costs between the lighting and the framebuffer
+void reportVertexFormat()
+{
+    int before = 3 * sizeof(double) + 3 * sizeof(double);
+    int after = sizeof(unsigned) + (quantizePositions ? sizeof(QuantPos) : sizeof(Point3));
+    cout << "vertex format: " << after << " bytes/vertex (rgba8 + "
+         << (quantizePositions ? "16 bit" : "float") << " position), was "
+         << before << ", saves " << before - after << "\n";
+}
+
+#ifdef LIGHT_DOUBLE
+#define GL_REAL GL_DOUBLE
+#else
+#define GL_REAL GL_FLOAT
+#endif
+
+//hand the packed batch to openGL as vertex arrays
+void drawBatchGL(const ShadedBatch& batch)
+{
+    if (!batch.size())
+        return;
+    countMetric(METRIC_TRIANGLES, batch.index.size() / 3);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, &batch.packed[0]);
+
+    glPushMatrix();
+    if (quantizePositions)
+    {
+        //let the modelview matrix undo the quantization
+        glTranslated(batch.frame.cx, batch.frame.cy, batch.frame.cz);
+        glScaled(batch.frame.scale, batch.frame.scale, batch.frame.scale);
+        glVertexPointer(3, GL_SHORT, sizeof(QuantPos), &batch.qpos[0].x);
+    }
+    else
+        glVertexPointer(3, GL_REAL, sizeof(Point3), &batch.pos[0].x);
+
+    glDrawElements(GL_TRIANGLES, (GLsizei)batch.index.size(), GL_UNSIGNED_INT, &batch.index[0]);
+    glPopMatrix();
+
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+//software renderer --------------------------------
+//draws the same batch on the cpu into an rgba8 framebuffer,
+//row 0 is the bottom row like glDrawPixels expects
+
+const int VIEW_W = 640, VIEW_H = 430;
+const unsigned CLEAR_COLOR = 0x00808080;
+bool softwareRender = false;
+
+//what this frame is drawn with, the quality controller sets these
+bool perPixelShading = false;   //light every pixel instead of blending vertex colors
+float renderScale = 1;          //software resolution as a fraction of the viewport
+int activeLights = INT_MAX;     //the sun counts as one
+int sunSlices = 20;             //detail of the sun sphere
+
+struct Framebuffer
+{
+    static const bool floatColor = false;
+    int w, h;
+    vector<unsigned> color;
+
+    Framebuffer() : w(0), h(0) {}
+    void resize(int ww, int hh) { w = ww; h = hh; color.resize(w * h); }
+    void clear(unsigned c) { fill(color.begin(), color.end(), c); }
+    void put(int x, int y, const float rgba[4]) { color[y * w + x] = packColor(rgba); }
+};
+
+//hdr mode keeps the unclamped radiance as float rgba until the tone mapping pass
+bool hdrMode = false;
+
+struct HdrFramebuffer
+{
+    static const bool floatColor = true;
+    int w, h;
+    vector<float> rgba;
+
+    HdrFramebuffer() : w(0), h(0) {}
+    void resize(int ww, int hh) { w = ww; h = hh; rgba.resize(4 * w * h); }
+    void clear(const float c[4])
+    {
+        for (int i = 0; i < w * h; i++)
+            memcpy(&rgba[4 * i], c, 4 * sizeof(float));
+    }
+    void put(int x, int y, const float c[4]) { memcpy(&rgba[4 * (y * w + x)], c, 4 * sizeof(float)); }
+};
+
+//vertex after projection, x y in pixels and z the distance in front of the eye
+struct ScreenVertex
+{
+    float x, y, z;
+    float c[4];
+    unsigned index;     //which batch vertex it came from
+    unsigned other;     //a corner the near plane clip made lies s of the way from index to other
+    float s;            //0 for every vertex of the batch itself
+};
+
+//a point in eye space, depth in front of the eye, to pixels
+inline void projectEye(const Camera& c, Real xe, Real ye, Real depth, int w, int h, ScreenVertex& out)
+{
+    Real t = tan(c.viewAngle * 3.14159265 / 360);
+    out.x = (float)((xe / (depth * t * c.aspect) * .5 + .5) * w);
+    out.y = (float)((ye / (depth * t) * .5 + .5) * h);
+    out.z = (float)depth;
+}
+
+//the camera modelview, gluPerspective and the viewport in one step,
+//false when the point is behind the near plane
+bool projectVertex(const Camera& c, Point3 p, int w, int h, ScreenVertex& out)
+{
+    Vector3 d(c.eye, p);
+    Real xe = d.dot(c.u), ye = d.dot(c.v), depth = -d.dot(c.n);
+    if (depth < c.nearDist)
+        return false;
+    projectEye(c, xe, ye, depth, w, h, out);
+    return true;
+}
+
+//projectVertex backwards, the direction from the eye through the center of pixel
+//x, y, scaled so eye + d * depth is the point depth in front of the eye
+Vector3 pixelDirection(const Camera& c, int x, int y, int w, int h)
+{
+    Real t = tan(c.viewAngle * 3.14159265 / 360);
+    Real xe = ((x + .5) / w - .5) * 2 * t * c.aspect, ye = ((y + .5) / h - .5) * 2 * t;
+    return c.u * xe + c.v * ye - c.n;
+}
+
+Point3 pointAlong(Point3 p, Vector3 d, Real t)
+{
+    return Point3(p.x + d.x * t, p.y + d.y * t, p.z + d.z * t);
+}
+
+//a batch attribute at a screen vertex, blended for the corners of a clipped triangle
+inline Vector3 vertexAttribute(const vector<Vector3>& v, const ScreenVertex& a)
+{
+    return a.s == 0 ? v[a.index] : v[a.index] * (1 - a.s) + v[a.other] * a.s;
+}
+
+inline Point3 vertexAttribute(const vector<Point3>& v, const ScreenVertex& a)
+{
+    return a.s == 0 ? v[a.index] : pointAlong(v[a.index], Vector3(v[a.index], v[a.other]), a.s);
+}
+
+inline float vertexUV(const vector<float>& uv, const ScreenVertex& a, int k)
+{
+    return a.s == 0 ? uv[2 * a.index + k] : uv[2 * a.index + k] * (1 - a.s) + uv[2 * a.other + k] * a.s;
+}
+
+float edge(const ScreenVertex& a, const ScreenVertex& b, float x, float y)
+{
+    return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+}
+
+//colors lit per vertex, blended across the triangle
+struct GouraudShader
+{
+    void operator()(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex& c,
+                    float w0, float w1, float w2, float rgba[4]) const
+    {
+        for (int i = 0; i < 4; i++)
+            rgba[i] = w0 * a.c[i] + w1 * b.c[i] + w2 * c.c[i];
+    }
+};
+
+//screen space weights to perspective correct ones
+inline void perspectiveWeights(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex& c,
+                               float w0, float w1, float w2, float& p0, float& p1, float& p2)
+{
+    p0 = w0 / a.z;
+    p1 = w1 / b.z;
+    p2 = w2 / c.z;
+    float sum = 1 / (p0 + p1 + p2);
+    p0 *= sum; p1 *= sum; p2 *= sum;
+}
+
+//position and normal blended across the triangle and lit at every pixel as seen from eye
+struct PhongShader
+{
+    const ShadedBatch& batch;
+    Point3 eye;
+
+    PhongShader(const ShadedBatch& batch, Point3 eye) : batch(batch), eye(eye) {}
+
+    //albedo, when there is one, scales the material's ambient and diffuse colors,
+    //bump is a normal map texel, tangent space packed into 0..1
+    void operator()(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex& c,
+                    float w0, float w1, float w2, float rgba[4], const float* albedo = 0, const float* bump = 0) const
+    {
+        float p0, p1, p2;
+        perspectiveWeights(a, b, c, w0, w1, w2, p0, p1, p2);
+
+        Point3 pa = vertexAttribute(batch.pos, a), pb = vertexAttribute(batch.pos, b), pc = vertexAttribute(batch.pos, c);
+        Point3 p(p0 * pa.x + p1 * pb.x + p2 * pc.x, p0 * pa.y + p1 * pb.y + p2 * pc.y, p0 * pa.z + p1 * pb.z + p2 * pc.z);
+        Vector3 m = vertexAttribute(batch.normal, a) * p0 + vertexAttribute(batch.normal, b) * p1 + vertexAttribute(batch.normal, c) * p2;
+        m.normalize();
+        if (bump)
+        {
+            //the blended tangent made square to m again, the bitangent follows from the handedness
+            Vector3 t = vertexAttribute(batch.tangent, a) * p0 + vertexAttribute(batch.tangent, b) * p1 + vertexAttribute(batch.tangent, c) * p2;
+            t = t - m * t.dot(m);
+            t.normalize();
+            Vector3 bt = m.cross(t) * batch.handedness[a.index];
+            m = t * (2 * bump[0] - 1) + bt * (2 * bump[1] - 1) + m * (2 * bump[2] - 1);
+            m.normalize();
+        }
+
+        Material mat = batch.materials[batch.materialId[a.index]];
+        if (albedo)
+            for (int i = 0; i < 3; i++)
+            {
+                mat.Pa[i] *= albedo[i];
+                mat.Pd[i] *= albedo[i];
+            }
+        float amb[3];
+        batch.kernels[batch.materialId[a.index]](p, m, eye, mat, &batch.lights[0], (int)batch.lights.size(), ambientLight(m, amb), rgba);
+    }
+};
+
+//a new stamp when anything the cached diffuse depends on differs from what it was lit with
+void checkDiffuseCache(ShadedBatch& batch)
+{
+    DiffuseCache& cache = batch.cache;
+    bool same = cache.env == envLighting && cache.brdf == brdfLookup &&
+                (!envLighting || cache.environment == envSH.version) &&
+                cache.lights.size() == batch.lights.size() && cache.materials.size() == batch.materials.size();
+    for (size_t i = 0; same && i < batch.lights.size(); i++)
+    {
+        const PointLight &a = cache.lights[i], &b = batch.lights[i];
+        same = a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.pos.z == b.pos.z && a.scale == b.scale && a.radius == b.radius;
+    }
+    for (size_t i = 0; same && i < batch.materials.size(); i++)
+        same = memcmp(&cache.materials[i], &batch.materials[i], sizeof(Material)) == 0;
+    if (same)
+        return;
+
+    cache.stamp++;
+    cache.env = envLighting;
+    cache.brdf = brdfLookup;
+    cache.environment = envSH.version;
+    cache.lights = batch.lights;
+    cache.materials = batch.materials;
+}
+
+//the batch's lights that reach a mesh's bounds
+void partLights(const ShadedBatch& batch, const Mesh& mesh, vector<PointLight>& reach)
+{
+    reach.clear();
+    for (size_t i = 0; i < batch.lights.size(); i++)
+        if (batch.lights[i].radius <= 0 || boxDistance(batch.lights[i].pos, mesh.lo, mesh.hi) < batch.lights[i].radius)
+            reach.push_back(batch.lights[i]);
+}
+
+//bring the cached ambient plus diffuse of one part up to date, it is only lit
+//again when the part's stamp is stale
+void diffusePart(ShadedBatch& batch, int pi)
+{
+    const BatchPart& part = batch.parts[pi];
+    DiffuseCache& cache = batch.cache;
+    const Mesh& mesh = meshes[part.mesh];
+    if ((int)cache.partStamp.size() < pi + 1)
+    {
+        cache.partStamp.resize(pi + 1, 0);
+        cache.partMesh.resize(pi + 1, 0);
+        cache.partFirst.resize(pi + 1, 0);
+    }
+    if (cache.rgb.size() < 3 * (part.first + part.count))
+        cache.rgb.resize(3 * (part.first + part.count));
+
+    bool hit = diffuseCaching && cache.partStamp[pi] == cache.stamp && cache.partMesh[pi] == mesh.version && cache.partFirst[pi] == part.first;
+    (hit ? cache.hits : cache.misses) += part.count;
+    countMetric(hit ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, part.count);
+    cache.partStamp[pi] = diffuseCaching ? cache.stamp : 0;
+    cache.partMesh[pi] = mesh.version;
+    cache.partFirst[pi] = part.first;
+    if (hit)
+        return;
+
+    vector<PointLight> reach;
+    partLights(batch, mesh, reach);
+    const PointLight* lights = reach.empty() ? 0 : &reach[0];
+    int lightCount = (int)reach.size();
+    const Material& mat = batch.materials[mesh.material];
+    LightingKernel diffuse = pickKernel(TERMS_DIFFUSE, mat, lights, lightCount);
+    parallelFor(part.count, 1024, [&](int begin, int end, int) {
+        for (int i = part.first + begin; i < (int)part.first + end; i++)
+        {
+            float amb[3];
+            diffuse(batch.pos[i], batch.normal[i], batch.eye, mat, lights, lightCount, ambientLight(batch.normal[i], amb), &cache.rgb[3 * i]);
+        }
+    });
+}
+
+//the part's cached diffuse plus its specular seen from eye, into rgba per batch
+//vertex. it only reads the batch, so views can each add their own at once
+void specularPart(const ShadedBatch& batch, int pi, Point3 eye, float* color)
+{
+    const BatchPart& part = batch.parts[pi];
+    const Mesh& mesh = meshes[part.mesh];
+    vector<PointLight> reach;
+    partLights(batch, mesh, reach);
+    const PointLight* lights = reach.empty() ? 0 : &reach[0];
+    int lightCount = (int)reach.size();
+    const Material& mat = batch.materials[mesh.material];
+    LightingKernel specular = pickKernel(TERMS_SPECULAR, mat, lights, lightCount);
+    countMetric(METRIC_VERTICES, part.count);
+    countMetric(METRIC_LIGHT_CALLS, (unsigned long long)part.count * lightCount);
+    if (specular.pow)
+        countMetric(METRIC_POW_CALLS, (unsigned long long)part.count * lightCount);
+
+    parallelFor(part.count, 1024, [&](int begin, int end, int) {
+        for (int i = part.first + begin; i < (int)part.first + end; i++)
+        {
+            float* c = color + 4 * i;
+            memcpy(c, &batch.cache.rgb[3 * i], 3 * sizeof(float));
+            c[3] = 1;
+            specular(batch.pos[i], batch.normal[i], eye, mat, lights, lightCount, 0, c);
+        }
+    });
+}
+
+//light the vertices of one part with the batch's own lights that reach its bounds
+void lightPart(ShadedBatch& batch, int pi)
+{
+    diffusePart(batch, pi);
+    specularPart(batch, pi, batch.eye, &batch.color[0]);
+}
+
+void reportDiffuseCache(DiffuseCache& cache)
+{
+    long long total = cache.hits + cache.misses;
+    cout << "diffuse cache: " << cache.hits << " vertex hits, " << cache.misses << " misses ("
+         << (total ? 100.0 * cache.hits / total : 0) << "% hits)\n";
+    cache.hits = cache.misses = 0;
+}
+
+//textures -----------------------------------------
+//one rgba8 texture with its whole mip chain, square and a power of two. texels
+//of a level are stored in z-order (morton) so a 2x2 bilinear footprint and
+//its neighbours share cache lines whichever way the view is rotated, the
+//row major order is kept for comparing against
+
+struct Texture
+{
+    int size;                   //of level 0
+    int levels;
+    bool morton;
+    vector<unsigned> texels;    //every level one after another
+    vector<int> offset;         //where each level starts
+
+    Texture() : size(0), levels(0), morton(true) {}
+    bool empty() const { return texels.empty(); }
+};
+
+Texture texture;
+bool texturing = false;
+Texture normalMap;              //tangent space normals packed into rgb
+bool normalMapping = false;
+bool mortonTexels = true;       //layout textures are built with
+
+//the low 16 bits of x moved to the even bits
+inline unsigned spreadBits(unsigned x)
+{
+    x &= 0xffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+//the 2x2 texels with x, y at the top left of level l, wrapped at the edges.
+//in z-order the step to x + 1 is an add with the y bits set so the carry
+//runs through them, and the x bits mask wraps it
+inline void footprint(const Texture& t, int l, int x, int y, const unsigned* c[4])
+{
+    int s = t.size >> l;
+    const unsigned* base = &t.texels[t.offset[l]];
+    x &= s - 1;
+    y &= s - 1;
+    if (t.morton)
+    {
+        unsigned xbits = spreadBits(s - 1), ybits = xbits << 1;
+        unsigned x0 = spreadBits(x), y0 = spreadBits(y) << 1;
+        unsigned x1 = ((x0 | ~xbits) + 1) & xbits, y1 = ((y0 | ~ybits) + 1) & ybits;
+        c[0] = base + (x0 | y0);
+        c[1] = base + (x1 | y0);
+        c[2] = base + (x0 | y1);
+        c[3] = base + (x1 | y1);
+        return;
+    }
+    int x1 = (x + 1) & (s - 1), y1 = (y + 1) & (s - 1);
+    c[0] = base + y * s + x;
+    c[1] = base + y * s + x1;
+    c[2] = base + y1 * s + x;
+    c[3] = base + y1 * s + x1;
+}
+
+//rows of size x size rgba8 into t, each level a 2x2 box filter of the one before
+void buildTexture(Texture& t, const vector<unsigned>& rows, int size, bool morton)
+{
+    t.size = size;
+    t.morton = morton;
+    t.levels = 1;
+    while ((size >> (t.levels - 1)) > 1)
+        t.levels++;
+    t.offset.resize(t.levels);
+    int total = 0;
+    for (int l = 0; l < t.levels; l++)
+    {
+        t.offset[l] = total;
+        total += (size >> l) * (size >> l);
+    }
+    t.texels.resize(total);
+
+    vector<unsigned> level = rows, next;
+    for (int l = 0; l < t.levels; l++)
+    {
+        int s = size >> l;
+        unsigned* out = &t.texels[t.offset[l]];
+        parallelFor(s, 64, [&](int begin, int end, int) {
+            for (int y = begin; y < end; y++)
+                for (int x = 0; x < s; x++)
+                    out[morton ? spreadBits(x) | spreadBits(y) << 1 : y * s + x] = level[y * s + x];
+        });
+        if (s == 1)
+            break;
+
+        int h = s / 2;
+        next.resize(h * h);
+        parallelFor(h, 64, [&](int begin, int end, int) {
+            for (int y = begin; y < end; y++)
+                for (int x = 0; x < h; x++)
+                {
+                    unsigned c = 0;
+                    for (int k = 0; k < 4; k++)
+                    {
+                        int sum = 2;
+                        for (int j = 0; j < 4; j++)
+                            sum += (level[(2 * y + j / 2) * s + 2 * x + j % 2] >> (8 * k)) & 255;
+                        c |= (unsigned)(sum / 4) << (8 * k);
+                    }
+                    next[y * h + x] = c;
+                }
+        });
+        level.swap(next);
+    }
+}
+
+//8x8 squares of two shades with a border, the mips blur them into one tone
+void makeCheckerTexture(Texture& t, int size, bool morton)
+{
+    vector<unsigned> rows(size * size);
+    int square = size / 8;
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+        {
+            bool border = x % square == 0 || y % square == 0;
+            bool dark = (x / square + y / square) % 2 != 0;
+            rows[y * size + x] = border ? 0xff303030 : dark ? 0xff9090a0 : 0xfff0f0f0;
+        }
+    buildTexture(t, rows, size, morton);
+}
+
+//rounded tiles on the checker's grid as a height field, turned into tangent
+//space normals from its slopes, strength scales how steep they look
+void makeTileNormalMap(Texture& t, int size, bool morton, float strength)
+{
+    vector<float> height(size * size);
+    int square = size / 8;
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+        {
+            //distance to the nearest groove in squares, flat on top with rounded edges
+            float fx = (float)(x % square) / square, fy = (float)(y % square) / square;
+            float edge = min(min(fx, 1 - fx), min(fy, 1 - fy));
+            height[y * size + x] = min(edge * 8, 1.0f);
+        }
+
+    vector<unsigned> rows(size * size);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+        {
+            float dx = height[y * size + (x + 1) % size] - height[y * size + (x + size - 1) % size];
+            float dy = height[(y + 1) % size * size + x] - height[(y + size - 1) % size * size + x];
+            Vector3 n(-dx * strength, -dy * strength, 1);
+            n.normalize();
+            float rgba[4] = { (float)(n.x * .5 + .5), (float)(n.y * .5 + .5), (float)(n.z * .5 + .5), 1 };
+            rows[y * size + x] = packColor(rgba);
+        }
+    buildTexture(t, rows, size, morton);
+}
+
+//a ppm stretched to the next power of two square with bilinear filtering
+bool loadTexture(const char* path, Texture& t, bool morton)
+{
+    int w, h;
+    vector<unsigned char> rgb;
+    if (!readPPM(path, w, h, rgb))
+        return false;
+
+    int size = 1;
+    while (size < max(w, h) && size < 4096)
+        size *= 2;
+    vector<unsigned> rows(size * size);
+    parallelFor(size, 16, [&](int begin, int end, int) {
+        for (int y = begin; y < end; y++)
+            for (int x = 0; x < size; x++)
+            {
+                float fx = max(0.0f, (x + .5f) * w / size - .5f), fy = max(0.0f, (y + .5f) * h / size - .5f);
+                int x0 = min((int)fx, w - 1), y0 = min((int)fy, h - 1);
+                int x1 = min(x0 + 1, w - 1), y1 = min(y0 + 1, h - 1);
+                float tx = fx - x0, ty = fy - y0;
+                unsigned c = 0xff000000;
+                for (int k = 0; k < 3; k++)
+                {
+                    float top = rgb[3 * (y0 * w + x0) + k] * (1 - tx) + rgb[3 * (y0 * w + x1) + k] * tx;
+                    float bottom = rgb[3 * (y1 * w + x0) + k] * (1 - tx) + rgb[3 * (y1 * w + x1) + k] * tx;
+                    c |= (unsigned)(top * (1 - ty) + bottom * ty + .5f) << (8 * k);
+                }
+                rows[y * size + x] = c;
+            }
+    });
+    buildTexture(t, rows, size, morton);
+    return true;
+}
+
+#ifdef LIGHT_SSE2
+inline __m128 texelColor(unsigned c)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i p = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)c), zero), zero);
+    return _mm_mul_ps(_mm_cvtepi32_ps(p), _mm_set1_ps(1.0f / 255));
+}
+#endif
+
+//trilinear samples for the four lanes set in mask, lod in levels from 0 up.
+//the footprints are worked out for all four at once, the eight taps of a
+//lane are blended with the channels side by side
+void sampleTexture4(const Texture& t, const float u[4], const float v[4], const float lod[4], int mask, float out[4][4])
+{
+    float tu[4], tv[4], fl[4];
+    int l0[4];
+#ifdef LIGHT_SSE2
+    __m128 top = _mm_set1_ps((float)(t.levels - 1));
+    __m128 level = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(lod), _mm_setzero_ps()), top);
+    __m128i whole = _mm_cvttps_epi32(level);
+    _mm_storeu_ps(fl, _mm_sub_ps(level, _mm_cvtepi32_ps(whole)));
+    _mm_storeu_si128((__m128i*)l0, whole);
+    //u, v wrapped into 0..1 so the texel math stays small
+    __m128 fu = _mm_loadu_ps(u), fv = _mm_loadu_ps(v);
+    fu = _mm_sub_ps(fu, _mm_cvtepi32_ps(_mm_cvttps_epi32(fu)));
+    fv = _mm_sub_ps(fv, _mm_cvtepi32_ps(_mm_cvttps_epi32(fv)));
+    __m128 one = _mm_set1_ps(1);
+    fu = _mm_add_ps(fu, _mm_and_ps(_mm_cmplt_ps(fu, _mm_setzero_ps()), one));
+    fv = _mm_add_ps(fv, _mm_and_ps(_mm_cmplt_ps(fv, _mm_setzero_ps()), one));
+    _mm_storeu_ps(tu, fu);
+    _mm_storeu_ps(tv, fv);
+#else
+    for (int k = 0; k < 4; k++)
+    {
+        float level = min(max(lod[k], 0.0f), (float)(t.levels - 1));
+        l0[k] = (int)level;
+        fl[k] = level - l0[k];
+        tu[k] = u[k] - floor(u[k]);
+        tv[k] = v[k] - floor(v[k]);
+    }
+#endif
+
+    for (int k = 0; k < 4; k++)
+    {
+        if (!(mask & (1 << k)))
+            continue;
+        int levels = fl[k] > 0 && l0[k] + 1 < t.levels ? 2 : 1;
+#ifdef LIGHT_SSE2
+        __m128 acc = _mm_setzero_ps();
+#else
+        float acc[4] = { 0, 0, 0, 0 };
+#endif
+        for (int j = 0; j < levels; j++)
+        {
+            int l = l0[k] + j, s = t.size >> l;
+            float lw = j ? fl[k] : 1 - (levels == 2 ? fl[k] : 0);
+            float x = tu[k] * s - .5f, y = tv[k] * s - .5f;
+            int x0 = (int)floor(x), y0 = (int)floor(y);
+            float ax = x - x0, ay = y - y0;
+            float wt[4] = { (1 - ax) * (1 - ay) * lw, ax * (1 - ay) * lw, (1 - ax) * ay * lw, ax * ay * lw };
+            const unsigned* c[4];
+            footprint(t, l, x0, y0, c);
+            for (int n = 0; n < 4; n++)
+            {
+#ifdef LIGHT_SSE2
+                acc = _mm_add_ps(acc, _mm_mul_ps(texelColor(*c[n]), _mm_set1_ps(wt[n])));
+#else
+                float rgba[4];
+                unpackColor(*c[n], rgba);
+                for (int i = 0; i < 4; i++)
+                    acc[i] += rgba[i] * wt[n];
+#endif
+            }
+        }
+#ifdef LIGHT_SSE2
+        _mm_storeu_ps(out[k], acc);
+#else
+        memcpy(out[k], acc, sizeof(acc));
+#endif
+    }
+}
+
+//the same screen of sample positions run through a morton and a row major
+//copy of one big texture, with the uv grid turned by a few angles, one texel
+//per pixel so only the fetches differ
+int benchTexture(int size)
+{
+    const int W = 1024, H = 1024;
+    srand(1);
+    vector<unsigned> rows(size * size);
+    for (size_t i = 0; i < rows.size(); i++)
+        rows[i] = (unsigned)rand() * 2654435761u;
+
+    Texture layouts[2];
+    buildTexture(layouts[0], rows, size, false);
+    buildTexture(layouts[1], rows, size, true);
+    const char* names[2] = { "row major", "morton   " };
+    const float angles[3] = { 0, 45, 90 };
+    const float lods[2] = { 0, .5f };
+
+    for (int a = 0; a < 3; a++)
+        for (int li = 0; li < 2; li++)
+        {
+            float ca = cos(angles[a] * 3.14159265f / 180), sa = sin(angles[a] * 3.14159265f / 180);
+            vector<float> sum(workers().size());
+            //best of a few rounds, the layouts take turns so they see the same machine
+            double best[2] = { 1e30, 1e30 };
+            for (int round = 0; round < 5; round++)
+                for (int k = 0; k < 2; k++)
+                {
+                    const Texture& t = layouts[k];
+                    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                    parallelFor(H, 8, [&](int begin, int end, int worker) {
+                        float lod[4] = { lods[li], lods[li], lods[li], lods[li] };
+                        for (int y = begin; y < end; y++)
+                            for (int x = 0; x < W; x += 4)
+                            {
+                                float u[4], v[4], out[4][4];
+                                for (int i = 0; i < 4; i++)
+                                {
+                                    u[i] = ((x + i) * ca - y * sa) / size;
+                                    v[i] = ((x + i) * sa + y * ca) / size;
+                                }
+                                sampleTexture4(t, u, v, lod, 15, out);
+                                sum[worker] += out[0][0] + out[3][2];
+                            }
+                    });
+                    best[k] = min(best[k], chrono::duration<double>(chrono::steady_clock::now() - start).count());
+                }
+
+            double rate[2];
+            for (int k = 0; k < 2; k++)
+            {
+                rate[k] = (double)W * H * (lods[li] > 0 ? 8 : 4) / best[k] / 1e6;
+                cout << "texture " << size << "^2 " << names[k] << " " << angles[a] << " deg, "
+                     << (lods[li] > 0 ? "trilinear" : "bilinear ") << ": " << rate[k] << " M texels/s\n";
+            }
+            cout << "  morton / row major " << rate[1] / rate[0] << "x\n";
+        }
+    return 0;
+}
+
+//tiled rasterizer ---------------------------------
+//triangles are first binned into the screen tiles they touch, then each tile
+//is drawn start to finish by one worker, tiles never share pixels and a tile's
+//depth is one contiguous block that stays in cache the whole time.
+//meshes go front to back in layers, after each layer every tile it touched
+//refreshes its part of a two level depth pyramid, the farthest depth of each
+//8x8 block and of the whole tile, and later meshes and triangles whose nearest
+//point is behind that are dropped before they are lit, set up or drawn
+
+const int TILE_SIZE = 64;       //multiple of 4, one row of the tile is whole sse registers
+const int HIZ_BLOCK = 8;        //pixels on a side of the pyramid's fine level
+const int HIZ_BLOCKS = TILE_SIZE / HIZ_BLOCK;
+const int LAYER_TRIANGLES = 4096;   //roughly how much is drawn between pyramid updates
+
+//edge equations of a projected triangle, w = A x + B y + C is the barycentric
+//weight of the opposite vertex, already divided by the area so inside is w >= 0
+struct TriangleSetup
+{
+    unsigned v[3];      //screen vertices
+    float A[3], B[3], C[3];
+    float iz[3];        //1/z per vertex, interpolates linearly on screen
+    float nearZ;        //largest of the three, the nearest the triangle gets
+    int x0, y0, x1, y1; //pixel bounds, inclusive
+};
+
+//what the pyramid saved in the last frame
+struct OcclusionStats
+{
+    int objects, objectsRejected;
+    long long triangles, trianglesRejected;
+};
+
+//what binning did with a triangle of the layer
+enum { TRIANGLE_DRAWN, TRIANGLE_DROPPED, TRIANGLE_REJECTED };
+
+//per frame state of the rasterizer, kept around so the vectors keep their memory
+struct TileRaster
+{
+    int w, h, tilesX, tilesY, chunks;
+    vector<ScreenVertex> screen;
+    vector<char> inFront;               //vertex is past the near plane
+    vector<TriangleSetup> tris;         //one per batch triangle, filled as layers are drawn, then the clipped ones
+    vector<unsigned> layer;             //triangles of the layer being drawn
+    vector<unsigned> clipped;           //the layer again with the near plane crossings split
+    vector<vector<unsigned> > bins;     //[chunk * tiles + tile], submission order inside a tile
+    vector<int> active;                 //tiles with something binned this layer
+    vector<float> depth;                //1/z, 0 is empty, TILE_SIZE^2 per tile one tile after another
+    vector<float> blockZ;               //farthest 1/z of each HIZ_BLOCK square, HIZ_BLOCKS^2 per tile
+    vector<float> tileZ;                //farthest 1/z of each tile
+    vector<long long> rejected;         //triangles the pyramid dropped, per chunk
+    vector<long long> dropped;          //behind, off screen or too thin to cover a pixel, per chunk
+    vector<char> fate;                  //TRIANGLE_* of each slot of the layer
+    vector<unsigned> halves;            //slots of the layer holding the second half of a split triangle
+    OcclusionStats stats;
+};
+
+TileRaster tileRaster;
+bool occlusionCulling = true;
+
+//what one of several cameras drawing the same batch at once keeps to itself,
+//its rasterizer and its vertex colors. the batch's diffuse has to be lit for
+//every part before, a view only reads it and adds its own specular
+struct BatchView
+{
+    TileRaster raster;
+    vector<float> color;        //rgba per batch vertex, like ShadedBatch::color
+    vector<unsigned> packed;
+};
+
+bool setupTriangle(TriangleSetup& t, const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex& c, int w, int h)
+{
+    float area = edge(a, b, c.x, c.y);
+    if (area == 0)
+        return false;
+
+    t.x0 = max(0, (int)floor(min(a.x, min(b.x, c.x))));
+    t.x1 = min(w - 1, (int)ceil(max(a.x, max(b.x, c.x))));
+    t.y0 = max(0, (int)floor(min(a.y, min(b.y, c.y))));
+    t.y1 = min(h - 1, (int)ceil(max(a.y, max(b.y, c.y))));
+    if (t.x0 > t.x1 || t.y0 > t.y1)
+        return false;
+
+    //edge opposite each vertex, same as edge(b, c, x, y) / area and so on
+    const ScreenVertex* from[3] = { &b, &c, &a };
+    const ScreenVertex* to[3]   = { &c, &a, &b };
+    float inv = 1 / area;
+    for (int i = 0; i < 3; i++)
+    {
+        float dx = to[i]->x - from[i]->x, dy = to[i]->y - from[i]->y;
+        t.A[i] = -dy * inv;
+        t.B[i] = dx * inv;
+        t.C[i] = (dy * from[i]->x - dx * from[i]->y) * inv;
+    }
+    t.iz[0] = 1 / a.z;
+    t.iz[1] = 1 / b.z;
+    t.iz[2] = 1 / c.z;
+    t.nearZ = max(t.iz[0], max(t.iz[1], t.iz[2]));
+    return true;
+}
+
+//true when everything drawn so far over the pixels x0..x1, y0..y1 is nearer than nearZ,
+//the tiles are checked first and the blocks only under tiles that can't decide
+bool occluded(const TileRaster& r, int x0, int y0, int x1, int y1, float nearZ)
+{
+    for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+        for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+        {
+            int tile = ty * r.tilesX + tx;
+            if (r.tileZ[tile] > nearZ)
+                continue;
+
+            int ox = tx * TILE_SIZE, oy = ty * TILE_SIZE;
+            int bx0 = (max(x0, ox) - ox) / HIZ_BLOCK, bx1 = (min(x1, ox + TILE_SIZE - 1) - ox) / HIZ_BLOCK;
+            int by0 = (max(y0, oy) - oy) / HIZ_BLOCK, by1 = (min(y1, oy + TILE_SIZE - 1) - oy) / HIZ_BLOCK;
+            const float* z = &r.blockZ[tile * HIZ_BLOCKS * HIZ_BLOCKS];
+            for (int by = by0; by <= by1; by++)
+                for (int bx = bx0; bx <= bx1; bx++)
+                    if (z[by * HIZ_BLOCKS + bx] <= nearZ)
+                        return false;
+        }
+    return true;
+}
+
+//a world space box against the pyramid, rejected when it is off screen or hidden
+//over the whole rectangle its corners cover, a box reaching past the near plane is kept
+bool boxOccluded(const TileRaster& r, const Camera& c, Point3 lo, Point3 hi)
+{
+    float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX, nearZ = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        Point3 p(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z);
+        ScreenVertex sv;
+        if (!projectVertex(c, p, r.w, r.h, sv))
+            return false;
+        x0 = min(x0, sv.x);
+        x1 = max(x1, sv.x);
+        y0 = min(y0, sv.y);
+        y1 = max(y1, sv.y);
+        nearZ = max(nearZ, 1 / sv.z);
+    }
+
+    int ix0 = max(0, (int)floor(x0)), ix1 = min(r.w - 1, (int)ceil(x1));
+    int iy0 = max(0, (int)floor(y0)), iy1 = min(r.h - 1, (int)ceil(y1));
+    if (ix0 > ix1 || iy0 > iy1)
+        return true;
+    return occluded(r, ix0, iy0, ix1, iy1, nearZ);
+}
+
+//rebuild the pyramid over one tile from its depth, pixels off the screen are left out
+void updatePyramid(TileRaster& r, int tile)
+{
+    int ox = (tile % r.tilesX) * TILE_SIZE, oy = (tile / r.tilesX) * TILE_SIZE;
+    int w = min(TILE_SIZE, r.w - ox), h = min(TILE_SIZE, r.h - oy);
+    const float* depth = &r.depth[tile * TILE_SIZE * TILE_SIZE];
+    float* z = &r.blockZ[tile * HIZ_BLOCKS * HIZ_BLOCKS];
+
+    float farthest = FLT_MAX;
+    for (int by = 0; by * HIZ_BLOCK < h; by++)
+        for (int bx = 0; bx * HIZ_BLOCK < w; bx++)
+        {
+            float m = FLT_MAX;
+            for (int y = by * HIZ_BLOCK; y < min(h, (by + 1) * HIZ_BLOCK); y++)
+                for (int x = bx * HIZ_BLOCK; x < min(w, (bx + 1) * HIZ_BLOCK); x++)
+                    m = min(m, depth[y * TILE_SIZE + x]);
+            z[by * HIZ_BLOCKS + bx] = m;
+            farthest = min(farthest, m);
+        }
+    r.tileZ[tile] = farthest;
+}
+
+//coverage and depth test of the four pixels x..x+3 on row y, bit i of the
+//result is set when pixel x+i is inside, in the row bounds and nearer than zrow
+inline int coverage4(const TriangleSetup& t, int x, int y, int xEnd, const float* zrow, float w[3][4], float iz[4])
+{
+#ifdef LIGHT_SSE2
+    __m128 px = _mm_add_ps(_mm_set1_ps((float)x), _mm_set_ps(3.5f, 2.5f, 1.5f, .5f));
+    __m128 py = _mm_set1_ps(y + .5f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 depth = zero, inside = _mm_cmpge_ps(px, px);
+    for (int i = 0; i < 3; i++)
+    {
+        __m128 wi = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.A[i]), px), _mm_mul_ps(_mm_set1_ps(t.B[i]), py)), _mm_set1_ps(t.C[i]));
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(wi, zero));
+        depth = _mm_add_ps(depth, _mm_mul_ps(wi, _mm_set1_ps(t.iz[i])));
+        _mm_storeu_ps(w[i], wi);
+    }
+    inside = _mm_and_ps(inside, _mm_cmpgt_ps(depth, _mm_loadu_ps(zrow)));
+    _mm_storeu_ps(iz, depth);
+    int mask = _mm_movemask_ps(inside);
+#else
+    int mask = 0;
+    for (int k = 0; k < 4; k++)
+    {
+        float px = x + k + .5f, py = y + .5f;
+        bool inside = true;
+        iz[k] = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            w[i][k] = t.A[i] * px + t.B[i] * py + t.C[i];
+            inside = inside && w[i][k] >= 0;
+            iz[k] += w[i][k] * t.iz[i];
+        }
+        if (inside && iz[k] > zrow[k])
+            mask |= 1 << k;
+    }
+#endif
+    //lanes past the right end of the triangle's bounds
+    if (xEnd - x < 3)
+        mask &= (1 << (xEnd - x + 1)) - 1;
+    return mask;
+}
+
+//true when the whole 4x4 block at x, y is outside one of the edges
+inline bool blockOutside(const TriangleSetup& t, int x, int y)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        //the corner of the block where this edge function is largest
+        float cx = t.A[i] > 0 ? x + 4 : x, cy = t.B[i] > 0 ? y + 4 : y;
+        if (t.A[i] * cx + t.B[i] * cy + t.C[i] < 0)
+            return true;
+    }
+    return false;
+}
+
+//shaders light one pixel at a time unless they have their own way with the four of a row
+template <class Shader>
+inline void shadeRow(const Shader& shade, const TriangleSetup&, const ScreenVertex& a, const ScreenVertex& b,
+                     const ScreenVertex& c, const float w[3][4], int mask, float rgba[4][4])
+{
+    for (int k = 0; k < 4; k++)
+        if (mask & (1 << k))
+            shade(a, b, c, w[0][k], w[1][k], w[2][k], rgba[k]);
+}
+
+//the color texture modulates what the vertex colors or the per pixel lighting
+//give, per pixel it only tints the ambient and diffuse reflection so highlights
+//stay white. the normal map is only read per pixel, either may be missing
+struct TexturedShader
+{
+    const ShadedBatch& batch;
+    Point3 eye;
+    const Texture* albedo;
+    const Texture* normals;
+    bool perPixel;
+
+    TexturedShader(const ShadedBatch& batch, Point3 eye, const Texture* albedo, const Texture* normals, bool perPixel)
+        : batch(batch), eye(eye), albedo(albedo), normals(normals), perPixel(perPixel) {}
+};
+
+//uv and its screen space derivatives for the four lanes at once, the level
+//is log2 of the longer texel step, worked out in uv units and moved by each
+//texture's own size
+void shadeRow(const TexturedShader& shade, const TriangleSetup& t, const ScreenVertex& a, const ScreenVertex& b,
+              const ScreenVertex& c, const float w[3][4], int mask, float rgba[4][4])
+{
+    const ScreenVertex* corner[3] = { &a, &b, &c };
+    //u/z, v/z and 1/z interpolate linearly on screen, so do their x and y steps
+    float uz[3], vz[3], dudx = 0, dvdx = 0, dqdx = 0, dudy = 0, dvdy = 0, dqdy = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        uz[i] = vertexUV(shade.batch.uv, *corner[i], 0) * t.iz[i];
+        vz[i] = vertexUV(shade.batch.uv, *corner[i], 1) * t.iz[i];
+        dudx += t.A[i] * uz[i]; dvdx += t.A[i] * vz[i]; dqdx += t.A[i] * t.iz[i];
+        dudy += t.B[i] * uz[i]; dvdy += t.B[i] * vz[i]; dqdy += t.B[i] * t.iz[i];
+    }
+
+    float u[4], v[4], lod[4];
+#ifdef LIGHT_SSE2
+    __m128 w0 = _mm_loadu_ps(w[0]), w1 = _mm_loadu_ps(w[1]), w2 = _mm_loadu_ps(w[2]);
+    __m128 q = _mm_add_ps(_mm_add_ps(_mm_mul_ps(w0, _mm_set1_ps(t.iz[0])), _mm_mul_ps(w1, _mm_set1_ps(t.iz[1]))), _mm_mul_ps(w2, _mm_set1_ps(t.iz[2])));
+    __m128 iq = _mm_div_ps(_mm_set1_ps(1), q);
+    __m128 pu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w0, _mm_set1_ps(uz[0])), _mm_mul_ps(w1, _mm_set1_ps(uz[1]))), _mm_mul_ps(w2, _mm_set1_ps(uz[2]))), iq);
+    __m128 pv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w0, _mm_set1_ps(vz[0])), _mm_mul_ps(w1, _mm_set1_ps(vz[1]))), _mm_mul_ps(w2, _mm_set1_ps(vz[2]))), iq);
+    //d(U/q) = (dU - u dq) / q
+    __m128 ux = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(dudx), _mm_mul_ps(pu, _mm_set1_ps(dqdx))), iq);
+    __m128 vx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(dvdx), _mm_mul_ps(pv, _mm_set1_ps(dqdx))), iq);
+    __m128 uy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(dudy), _mm_mul_ps(pu, _mm_set1_ps(dqdy))), iq);
+    __m128 vy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(dvdy), _mm_mul_ps(pv, _mm_set1_ps(dqdy))), iq);
+    __m128 rho = _mm_max_ps(_mm_add_ps(_mm_mul_ps(ux, ux), _mm_mul_ps(vx, vx)), _mm_add_ps(_mm_mul_ps(uy, uy), _mm_mul_ps(vy, vy)));
+    rho = _mm_max_ps(rho, _mm_set1_ps(1e-30f));
+    //log2 from the float's exponent and mantissa bits, close enough to pick a level, halved for the square
+    __m128 bits = _mm_cvtepi32_ps(_mm_castps_si128(rho));
+    __m128 l2 = _mm_sub_ps(_mm_mul_ps(bits, _mm_set1_ps(1.0f / (1 << 23))), _mm_set1_ps(127));
+    _mm_storeu_ps(u, pu);
+    _mm_storeu_ps(v, pv);
+    _mm_storeu_ps(lod, _mm_mul_ps(l2, _mm_set1_ps(.5f)));
+#else
+    for (int k = 0; k < 4; k++)
+    {
+        float q = w[0][k] * t.iz[0] + w[1][k] * t.iz[1] + w[2][k] * t.iz[2];
+        u[k] = (w[0][k] * uz[0] + w[1][k] * uz[1] + w[2][k] * uz[2]) / q;
+        v[k] = (w[0][k] * vz[0] + w[1][k] * vz[1] + w[2][k] * vz[2]) / q;
+        float ux = (dudx - u[k] * dqdx) / q, vx = (dvdx - v[k] * dqdx) / q;
+        float uy = (dudy - u[k] * dqdy) / q, vy = (dvdy - v[k] * dqdy) / q;
+        float rho = max(ux * ux + vx * vx, uy * uy + vy * vy);
+        lod[k] = .5f * log2(max(rho, 1e-30f));
+    }
+#endif
+
+    float texel[4][4], bump[4][4], level[4];
+    if (shade.albedo)
+    {
+        for (int k = 0; k < 4; k++)
+            level[k] = lod[k] + shade.albedo->levels - 1;
+        sampleTexture4(*shade.albedo, u, v, level, mask, texel);
+    }
+    bool bumped = shade.normals && shade.perPixel;
+    if (bumped)
+    {
+        for (int k = 0; k < 4; k++)
+            level[k] = lod[k] + shade.normals->levels - 1;
+        sampleTexture4(*shade.normals, u, v, level, mask, bump);
+    }
+
+    for (int k = 0; k < 4; k++)
+    {
+        if (!(mask & (1 << k)))
+            continue;
+        if (shade.perPixel)
+        {
+            PhongShader(shade.batch, shade.eye)(a, b, c, w[0][k], w[1][k], w[2][k], rgba[k],
+                                                shade.albedo ? texel[k] : 0, bumped ? bump[k] : 0);
+            continue;
+        }
+        GouraudShader()(a, b, c, w[0][k], w[1][k], w[2][k], rgba[k]);
+        for (int i = 0; i < 3; i++)
+            rgba[k][i] *= texel[k][i];
+    }
+}
+
+//light() evaluations a shader makes per pixel of a triangle starting with a,
+//and whether they work out the pow, only the per pixel lighting makes any
+template <class Shader>
+inline int pixelLights(const Shader&, const ScreenVertex&, bool& pow)
+{
+    pow = false;
+    return 0;
+}
+
+inline int pixelLights(const PhongShader& shade, const ScreenVertex& a, bool& pow)
+{
+    pow = shade.batch.kernels[shade.batch.materialId[a.index]].pow;
+    return (int)shade.batch.lights.size();
+}
+
+inline int pixelLights(const TexturedShader& shade, const ScreenVertex& a, bool& pow)
+{
+    if (shade.perPixel)
+        return pixelLights(PhongShader(shade.batch, shade.eye), a, pow);
+    pow = false;
+    return 0;
+}
+
+//draw every triangle binned to one tile this layer, in 4x4 blocks of four pixel rows
+template <class Target, class Shader>
+void rasterTile(TileRaster& r, int tile, Target& fb, const Shader& shade)
+{
+    int ox = (tile % r.tilesX) * TILE_SIZE, oy = (tile / r.tilesX) * TILE_SIZE;
+    int ex = min(ox + TILE_SIZE, r.w) - 1, ey = min(oy + TILE_SIZE, r.h) - 1;
+    float* zbuf = &r.depth[tile * TILE_SIZE * TILE_SIZE];
+    const float* hiz = &r.blockZ[tile * HIZ_BLOCKS * HIZ_BLOCKS];
+
+    int tiles = r.tilesX * r.tilesY;
+    unsigned long long pixels = 0, lightCalls = 0, powCalls = 0;
+    for (int chunk = 0; chunk < r.chunks; chunk++)
+    {
+        const vector<unsigned>& bin = r.bins[chunk * tiles + tile];
+        for (size_t n = 0; n < bin.size(); n++)
+        {
+            const TriangleSetup& t = r.tris[bin[n]];
+            const ScreenVertex &a = r.screen[t.v[0]], &b = r.screen[t.v[1]], &c = r.screen[t.v[2]];
+            int shaded = 0;
+
+            //the triangle's bounds inside this tile, x and y start on a block corner
+            int x0 = ox + ((max(t.x0, ox) - ox) & ~3), x1 = min(t.x1, ex);
+            int y0 = oy + ((max(t.y0, oy) - oy) & ~3), y1 = min(t.y1, ey);
+
+            for (int by = y0; by <= y1; by += 4)
+                for (int bx = x0; bx <= x1; bx += 4)
+                {
+                    //the pyramid as it was when the layer started, it only gets nearer
+                    if (hiz[(by - oy) / HIZ_BLOCK * HIZ_BLOCKS + (bx - ox) / HIZ_BLOCK] > t.nearZ ||
+                        blockOutside(t, bx, by))
+                        continue;
+
+                    for (int y = max(by, t.y0); y <= min(by + 3, y1); y++)
+                    {
+                        float* zrow = zbuf + (y - oy) * TILE_SIZE + (bx - ox);
+                        float w[3][4], iz[4];
+                        int mask = coverage4(t, bx, y, x1, zrow, w, iz);
+                        if (bx < t.x0)
+                            mask &= ~((1 << (t.x0 - bx)) - 1);
+                        if (!mask)
+                            continue;
+
+                        float rgba[4][4];
+                        shadeRow(shade, t, a, b, c, w, mask, rgba);
+                        for (int k = 0; k < 4; k++)
+                            if (mask & (1 << k))
+                            {
+                                zrow[k] = iz[k];
+                                fb.put(bx + k, y, rgba[k]);
+                                shaded++;
+                            }
+                    }
+                }
+
+            //the triangle's pixels share its material, so its lights and kernel
+            bool pow;
+            int lights = pixelLights(shade, a, pow);
+            pixels += shaded;
+            lightCalls += (unsigned long long)shaded * lights;
+            if (pow)
+                powCalls += (unsigned long long)shaded * lights;
+        }
+    }
+    countMetric(METRIC_PIXELS, pixels);
+    countMetric(METRIC_LIGHT_CALLS, lightCalls);
+    countMetric(METRIC_POW_CALLS, powCalls);
+}
+
+//size everything for a w x h frame and empty the depth and the pyramid
+void beginRaster(TileRaster& r, const ShadedBatch& batch, int w, int h)
+{
+    r.w = w;
+    r.h = h;
+    r.tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+    r.tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles = r.tilesX * r.tilesY;
+
+    r.screen.resize(batch.size());
+    r.inFront.resize(batch.size());
+    r.tris.resize(batch.index.size() / 3);
+    r.layer.clear();
+    r.depth.resize(tiles * TILE_SIZE * TILE_SIZE);
+    parallelFor(tiles, 4, [&](int begin, int end, int) {
+        fill(r.depth.begin() + begin * TILE_SIZE * TILE_SIZE, r.depth.begin() + end * TILE_SIZE * TILE_SIZE, 0.0f);
+    });
+    r.blockZ.assign(tiles * HIZ_BLOCKS * HIZ_BLOCKS, 0.0f);
+    r.tileZ.assign(tiles, 0.0f);
+
+    OcclusionStats none = { 0, 0, 0, 0 };
+    r.stats = none;
+}
+
+//light a part's vertices when the shader wants colors and project them,
+//into the view's own colors when there is one
+void preparePart(TileRaster& r, ShadedBatch& batch, int pi, const Camera& c, bool floatColor, bool colors, BatchView* view)
+{
+    const BatchPart& part = batch.parts[pi];
+    float* color = view ? &view->color[0] : &batch.color[0];
+    unsigned* packed = view ? &view->packed[0] : &batch.packed[0];
+    if (colors)
+    {
+        if (!view)
+            diffusePart(batch, pi);
+        specularPart(batch, pi, c.eye, color);
+        if (!floatColor)
+            packColors(color + 4 * part.first, part.count, packed + part.first);
+    }
+
+    parallelFor(part.count, 2048, [&](int begin, int end, int) {
+        for (int j = part.first + begin; j < (int)part.first + end; j++)
+        {
+            ScreenVertex& sv = r.screen[j];
+            Point3 p = quantizePositions ? dequantize(batch.qpos[j], batch.frame) : batch.pos[j];
+            r.inFront[j] = projectVertex(c, p, r.w, r.h, sv);
+            sv.index = j;
+            sv.s = 0;
+            if (!colors)
+                continue;
+            if (floatColor)
+                memcpy(sv.c, color + 4 * j, 4 * sizeof(float));
+            else
+                unpackColor(packed[j], sv.c);
+        }
+    });
+}
+
+//the corner where the edge from vertex a in front to b behind meets the near plane
+unsigned clipEdge(TileRaster& r, const ShadedBatch& batch, const Camera& c, unsigned a, unsigned b)
+{
+    Point3 pa = quantizePositions ? dequantize(batch.qpos[a], batch.frame) : batch.pos[a];
+    Point3 pb = quantizePositions ? dequantize(batch.qpos[b], batch.frame) : batch.pos[b];
+    Vector3 da(c.eye, pa), db(c.eye, pb);
+    Real za = -da.dot(c.n), zb = -db.dot(c.n);
+    Real s = (za - c.nearDist) / (za - zb);
+
+    ScreenVertex sv;
+    projectEye(c, da.dot(c.u) * (1 - s) + db.dot(c.u) * s, da.dot(c.v) * (1 - s) + db.dot(c.v) * s, c.nearDist, r.w, r.h, sv);
+    const ScreenVertex &va = r.screen[a], &vb = r.screen[b];
+    for (int i = 0; i < 4; i++)
+        sv.c[i] = (float)(va.c[i] * (1 - s) + vb.c[i] * s);
+    sv.index = a;
+    sv.other = b;
+    sv.s = (float)s;
+    r.screen.push_back(sv);
+    r.inFront.push_back(1);
+    return (unsigned)r.screen.size() - 1;
+}
+
+//replace the layer's triangles that cross the near plane by the part in front,
+//one triangle or two, whose vertices and setups go after the batch's own.
+//the few crossings are done here in order, before the layer is binned
+void clipLayer(TileRaster& r, const ShadedBatch& batch, const Camera& c)
+{
+    r.halves.clear();
+    size_t n = 0;
+    for (; n < r.layer.size(); n++)
+    {
+        const unsigned* v = &batch.index[3 * r.layer[n]];
+        int front = r.inFront[v[0]] + r.inFront[v[1]] + r.inFront[v[2]];
+        if (front == 1 || front == 2)
+            break;
+    }
+    if (n == r.layer.size())
+        return;
+
+    r.clipped.assign(r.layer.begin(), r.layer.begin() + n);
+    for (; n < r.layer.size(); n++)
+    {
+        const unsigned* v = &batch.index[3 * r.layer[n]];
+        int front = r.inFront[v[0]] + r.inFront[v[1]] + r.inFront[v[2]];
+        if (front != 1 && front != 2)
+        {
+            //wholly behind is dropped when binned
+            r.clipped.push_back(r.layer[n]);
+            continue;
+        }
+
+        //walk the edges keeping what is in front, three or four corners in the same winding
+        unsigned poly[4];
+        int corners = 0;
+        for (int k = 0; k < 3; k++)
+        {
+            unsigned a = v[k], b = v[(k + 1) % 3];
+            if (r.inFront[a])
+                poly[corners++] = a;
+            if (r.inFront[a] != r.inFront[b])
+                poly[corners++] = r.inFront[a] ? clipEdge(r, batch, c, a, b) : clipEdge(r, batch, c, b, a);
+        }
+        for (int k = 2; k < corners; k++)
+        {
+            TriangleSetup t;
+            t.v[0] = poly[0];
+            t.v[1] = poly[k - 1];
+            t.v[2] = poly[k];
+            if (k == 3)
+                r.halves.push_back((unsigned)r.clipped.size());
+            r.clipped.push_back((unsigned)r.tris.size());
+            r.tris.push_back(t);
+        }
+    }
+    r.layer.swap(r.clipped);
+}
+
+//set up the layer's triangles and bin them in parallel, each chunk of the
+//layer gets its own bins so nothing is shared and the order stays the same
+void binLayer(TileRaster& r, const ShadedBatch& batch, const Camera& c)
+{
+    clipLayer(r, batch, c);
+    unsigned batchTris = (unsigned)batch.index.size() / 3;
+    int count = (int)r.layer.size(), tiles = r.tilesX * r.tilesY;
+    r.chunks = max(1, min(count, workers().size() * 4));
+    if ((int)r.bins.size() < r.chunks * tiles)
+        r.bins.resize(r.chunks * tiles);
+    for (int i = 0; i < r.chunks * tiles; i++)
+        r.bins[i].clear();
+    r.rejected.assign(r.chunks, 0);
+    r.dropped.assign(r.chunks, 0);
+    r.fate.resize(count);
+
+    workers().run(r.chunks, [&](int chunk, int) {
+        int begin = (int)((long long)count * chunk / r.chunks), end = (int)((long long)count * (chunk + 1) / r.chunks);
+        int dropped = 0;
+        for (int n = begin; n < end; n++)
+        {
+            unsigned i = r.layer[n];
+            TriangleSetup& t = r.tris[i];
+            const unsigned* v = i < batchTris ? &batch.index[3 * i] : t.v;
+            if (!r.inFront[v[0]] || !r.inFront[v[1]] || !r.inFront[v[2]] ||
+                !setupTriangle(t, r.screen[v[0]], r.screen[v[1]], r.screen[v[2]], r.w, r.h))
+            {
+                dropped++;
+                r.fate[n] = TRIANGLE_DROPPED;
+                continue;
+            }
+            if (occlusionCulling && occluded(r, t.x0, t.y0, t.x1, t.y1, t.nearZ))
+            {
+                r.rejected[chunk]++;
+                r.fate[n] = TRIANGLE_REJECTED;
+                continue;
+            }
+            r.fate[n] = TRIANGLE_DRAWN;
+            t.v[0] = v[0];
+            t.v[1] = v[1];
+            t.v[2] = v[2];
+
+            for (int ty = t.y0 / TILE_SIZE; ty <= t.y1 / TILE_SIZE; ty++)
+                for (int tx = t.x0 / TILE_SIZE; tx <= t.x1 / TILE_SIZE; tx++)
+                    r.bins[chunk * tiles + ty * r.tilesX + tx].push_back(i);
+        }
+        r.dropped[chunk] = dropped;
+    });
+
+    long long dropped = 0, rejected = 0;
+    for (int chunk = 0; chunk < r.chunks; chunk++)
+    {
+        dropped += r.dropped[chunk];
+        rejected += r.rejected[chunk];
+    }
+
+    //both halves of a triangle the near plane split were counted, the triangle
+    //itself is culled once when neither was drawn
+    for (size_t k = 0; k < r.halves.size(); k++)
+    {
+        char a = r.fate[r.halves[k] - 1], b = r.fate[r.halves[k]];
+        dropped -= (a == TRIANGLE_DROPPED) + (b == TRIANGLE_DROPPED);
+        rejected -= (a == TRIANGLE_REJECTED) + (b == TRIANGLE_REJECTED);
+        if (a != TRIANGLE_DRAWN && b != TRIANGLE_DRAWN)
+            (a == TRIANGLE_REJECTED || b == TRIANGLE_REJECTED ? rejected : dropped)++;
+    }
+    countMetric(METRIC_CULLED, dropped + rejected);
+    r.stats.trianglesRejected += rejected;
+}
+
+//draw every tile the layer touched, one tile per task, and refresh the
+//pyramid over each tile as soon as it is done
+template <class Target, class Shader>
+void rasterLayer(TileRaster& r, Target& fb, const Shader& shade)
+{
+    int tiles = r.tilesX * r.tilesY;
+    r.active.clear();
+    for (int tile = 0; tile < tiles; tile++)
+        for (int chunk = 0; chunk < r.chunks; chunk++)
+            if (!r.bins[chunk * tiles + tile].empty())
+            {
+                r.active.push_back(tile);
+                break;
+            }
+
+    workers().run((int)r.active.size(), [&](int n, int) {
+        rasterTile(r, r.active[n], fb, shade);
+        updatePyramid(r, r.active[n]);
+    });
+}
+
+//vertices are lit for the rasterizer unless it lights every pixel itself
+template <class Target>
+bool vertexColors(const Target&) { return !perPixelShading; }
+
+template <class Target>
+void drawLayer(TileRaster& r, const ShadedBatch& batch, Target& fb, const Camera& c)
+{
+    binLayer(r, batch, c);
+    Point3 eye = c.eye;
+    const Texture* albedo = texturing && !texture.empty() ? &texture : 0;
+    const Texture* normals = normalMapping && perPixelShading && !normalMap.empty() ? &normalMap : 0;
+    if (albedo || normals)
+        rasterLayer(r, fb, TexturedShader(batch, eye, albedo, normals, perPixelShading));
+    else if (perPixelShading)
+        rasterLayer(r, fb, PhongShader(batch, eye));
+    else
+        rasterLayer(r, fb, GouraudShader());
+    r.layer.clear();
+}
+
+//the software side of drawBatchGL, reads the same packed colors and positions,
+//an HdrFramebuffer takes the float colors from before the output stage instead.
+//the batch comes unlit, only the parts that survive the pyramid are lit here.
+//a view brings its own rasterizer and colors and leaves the batch untouched
+template <class Target>
+void drawBatchSoftware(ShadedBatch& batch, const Camera& c, Target& fb, BatchView* view = 0)
+{
+    TileRaster& r = view ? view->raster : tileRaster;
+    beginRaster(r, batch, fb.w, fb.h);
+
+    //nearest first so the pyramid fills with the occluders early
+    vector<int> order(batch.parts.size());
+    vector<Real> dist(batch.parts.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const Mesh& mesh = meshes[batch.parts[i].mesh];
+        order[i] = (int)i;
+        dist[i] = boxDistance(c.eye, mesh.lo, mesh.hi);
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return dist[a] < dist[b]; });
+
+    for (size_t n = 0; n < order.size(); n++)
+    {
+        const BatchPart& part = batch.parts[order[n]];
+        const Mesh& mesh = meshes[part.mesh];
+        int tris = part.indexCount / 3;
+        r.stats.objects++;
+        r.stats.triangles += tris;
+        countMetric(METRIC_TRIANGLES, tris);
+        if (occlusionCulling && boxOccluded(r, c, mesh.lo, mesh.hi))
+        {
+            r.stats.objectsRejected++;
+            r.stats.trianglesRejected += tris;
+            countMetric(METRIC_CULLED, tris);
+            continue;
+        }
+
+        preparePart(r, batch, order[n], c, Target::floatColor, vertexColors(fb), view);
+        for (int i = 0; i < tris; i++)
+            r.layer.push_back(part.firstIndex / 3 + i);
+        if ((int)r.layer.size() >= LAYER_TRIANGLES)
+            drawLayer(r, batch, fb, c);
+    }
+    if (!r.layer.empty())
+        drawLayer(r, batch, fb, c);
+}
+
+void reportOcclusion(const OcclusionStats& s)
+{
+    cout << "occlusion: " << s.objectsRejected << "/" << s.objects << " objects, "
+         << s.trianglesRejected << "/" << s.triangles << " triangles rejected ("
+         << (s.triangles ? 100.0 * s.trianglesRejected / s.triangles : 0) << "%)\n";
+}
+
+//deferred shading ---------------------------------
+//the rasterizer writes only the normal and material of the nearest surface,
+//the depth is already in the tile rasterizer's buffer, then one pass lights
+//each covered pixel once, so the cost is pixels times lights however much
+//geometry was stacked up behind them
+
+enum GBufferLayout { GBUFFER_FLOAT, GBUFFER_OCTAHEDRAL };
+
+bool deferredShading = false;
+GBufferLayout gbufferLayout = GBUFFER_FLOAT;
+const unsigned char NO_MATERIAL = 255;
+
+//a unit normal folded onto the octahedron and flattened, two 16 bit snorms
+unsigned encodeOctahedral(const float n[3])
+{
+    float l1 = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+    float x = n[0] / l1, y = n[1] / l1;
+    if (n[2] < 0)
+    {
+        float fx = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+        y = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+        x = fx;
+    }
+    unsigned ex = (unsigned short)(short)floor(min(max(x, -1.0f), 1.0f) * 32767 + .5f);
+    unsigned ey = (unsigned short)(short)floor(min(max(y, -1.0f), 1.0f) * 32767 + .5f);
+    return ex | ey << 16;
+}
+
+void decodeOctahedral(unsigned e, float n[3])
+{
+    float x = (short)(e & 0xffff) * (1.0f / 32767), y = (short)(e >> 16) * (1.0f / 32767);
+    float z = 1 - fabs(x) - fabs(y);
+    if (z < 0)
+    {
+        float fx = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+        y = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+        x = fx;
+    }
+    float len = 1 / sqrt(x * x + y * y + z * z);
+    n[0] = x * len;
+    n[1] = y * len;
+    n[2] = z * len;
+}
+
+struct GBuffer
+{
+    static const bool floatColor = true;
+    int w, h;
+    GBufferLayout layout;
+    vector<float> normal;           //xyz per pixel in the float layout
+    vector<unsigned> octNormal;     //one packed normal per pixel in the octahedral layout
+    vector<unsigned char> material; //NO_MATERIAL where nothing was drawn
+
+    GBuffer() : w(0), h(0), layout(GBUFFER_FLOAT) {}
+    void resize(int ww, int hh, GBufferLayout l)
+    {
+        w = ww;
+        h = hh;
+        layout = l;
+        normal.resize(l == GBUFFER_FLOAT ? 3 * w * h : 0);
+        octNormal.resize(l == GBUFFER_OCTAHEDRAL ? w * h : 0);
+        material.resize(w * h);
+    }
+    void clear() { fill(material.begin(), material.end(), NO_MATERIAL); }
+
+    //rgb is the normal and a the material id, see GBufferShader
+    void put(int x, int y, const float v[4])
+    {
+        int i = y * w + x;
+        if (layout == GBUFFER_OCTAHEDRAL)
+            octNormal[i] = encodeOctahedral(v);
+        else
+            memcpy(&normal[3 * i], v, 3 * sizeof(float));
+        material[i] = (unsigned char)v[3];
+    }
+
+    Vector3 getNormal(int i) const
+    {
+        if (layout == GBUFFER_FLOAT)
+            return Vector3(normal[3 * i], normal[3 * i + 1], normal[3 * i + 2]);
+        float n[3];
+        decodeOctahedral(octNormal[i], n);
+        return Vector3(n[0], n[1], n[2]);
+    }
+
+    //the depth the rasterizer keeps counts too
+    int bytesPerPixel() const { return (int)sizeof(float) + (layout == GBUFFER_FLOAT ? 3 * sizeof(float) : sizeof(unsigned)) + 1; }
+};
+
+GBuffer gbuffer;
+
+//the normal blended like PhongShader does, but stored instead of lit
+struct GBufferShader
+{
+    const ShadedBatch& batch;
+
+    GBufferShader(const ShadedBatch& batch) : batch(batch) {}
+
+    void operator()(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex& c,
+                    float w0, float w1, float w2, float out[4]) const
+    {
+        float p0, p1, p2;
+        perspectiveWeights(a, b, c, w0, w1, w2, p0, p1, p2);
+        Vector3 m = vertexAttribute(batch.normal, a) * p0 + vertexAttribute(batch.normal, b) * p1 + vertexAttribute(batch.normal, c) * p2;
+        m.normalize();
+        out[0] = (float)m.x;
+        out[1] = (float)m.y;
+        out[2] = (float)m.z;
+        out[3] = batch.materialId[a.index];
+    }
+};
+
+//the g-buffer takes no vertex colors and its own shader
+bool vertexColors(const GBuffer&) { return false; }
+
+void drawLayer(TileRaster& r, const ShadedBatch& batch, GBuffer& g, const Camera& c)
+{
+    binLayer(r, batch, c);
+    rasterLayer(r, g, GBufferShader(batch));
+    r.layer.clear();
+}
+
+//light every covered pixel of g into fb, the position comes back from the depth
+template <class Target>
+int lightGBuffer(const GBuffer& g, const TileRaster& r, const ShadedBatch& batch, const Camera& c, Target& fb)
+{
+    const PointLight* lights = &batch.lights[0];
+    int lightCount = (int)batch.lights.size();
+    vector<int> lit(workers().size());
+    vector<long long> pows(workers().size());
+
+    parallelFor(g.h, 4, [&](int begin, int end, int worker) {
+        for (int y = begin; y < end; y++)
+        {
+            const float* zrow = &r.depth[(y / TILE_SIZE * r.tilesX) * TILE_SIZE * TILE_SIZE + (y % TILE_SIZE) * TILE_SIZE];
+            for (int x = 0; x < g.w; x++)
+            {
+                int i = y * g.w + x;
+                if (g.material[i] == NO_MATERIAL)
+                    continue;
+
+                Real depth = 1 / zrow[(x / TILE_SIZE) * TILE_SIZE * TILE_SIZE + x % TILE_SIZE];
+                Point3 p = pointAlong(c.eye, pixelDirection(c, x, y, g.w, g.h), depth);
+                Vector3 m = g.getNormal(i);
+
+                float amb[3], rgba[4];
+                const LightingKernel& kernel = batch.kernels[g.material[i]];
+                kernel(p, m, c.eye, batch.materials[g.material[i]], lights, lightCount, ambientLight(m, amb), rgba);
+                fb.put(x, y, rgba);
+                lit[worker]++;
+                pows[worker] += kernel.pow;
+            }
+        }
+    });
+
+    int total = 0;
+    long long powPixels = 0;
+    for (size_t w = 0; w < lit.size(); w++)
+    {
+        total += lit[w];
+        powPixels += pows[w];
+    }
+    countMetric(METRIC_LIGHT_CALLS, (unsigned long long)total * lightCount);
+    countMetric(METRIC_POW_CALLS, (unsigned long long)powPixels * lightCount);
+    return total;
+}
+
+int deferredLit = 0;    //pixels the last deferred frame lit
+
+//ray tracing --------------------------------------
+//a reference renderer, every pixel of the camera view casts a ray through the
+//batch, each hit sends a shadow ray to every light and a mirror ray along getR,
+//lit with the same shadePoint as the rasterizer. primary rays leave the eye
+//through the same pixel centers projectVertex maps to, so the images line up
+
+bool rayTracing = false;
+const int RAY_DEPTH = 3;        //primary ray plus two bounces
+const Real MIRROR = .25;        //how much of a bounce comes back, tinted by Ps
+
+//one triangle of the batch, edges from its first corner
+struct RayTriangle
+{
+    Point3 a;
+    Vector3 e1, e2;
+    unsigned v[3];
+};
+
+struct RayHit
+{
+    Real t, b1, b2;     //distance along the ray and weights of corners 1 and 2
+    int tri;
+};
+
+//bounding volume hierarchy -------------------------
+//binned surface area heuristic, each split tries BVH_BINS planes per axis and
+//keeps the one with the least expected cost. nodes are 32 bytes, the two
+//children of a node sit next to each other after it in the array, so a
+//refit is one backwards sweep. the binning of the big nodes near the root
+//is split over the workers, and the subtrees below them are built on the
+//workers side by side
+
+const int BVH_BINS = 16;
+const int BVH_LEAF = 4;     //a node this small always becomes a leaf
+const int BVH_DEPTH = 60;   //nor does anything deeper, traversal keeps a fixed stack
+const int BVH_TASK = 8192;  //a subtree this small is built whole by one worker
+
+struct BVHNode
+{
+    float lo[3], hi[3];
+    int first;  //leaf: first slot in order, inner: left child, the right one follows it
+    int count;  //triangles in a leaf, 0 for an inner node
+};
+
+struct BVH
+{
+    vector<BVHNode> nodes;
+    vector<unsigned> order;     //triangle ids, each leaf owns a run of them
+};
+
+struct BVHBox
+{
+    float lo[3], hi[3];
+
+    void empty()
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            lo[k] = FLT_MAX;
+            hi[k] = -FLT_MAX;
+        }
+    }
+    void grow(const float p[3])
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            lo[k] = min(lo[k], p[k]);
+            hi[k] = max(hi[k], p[k]);
+        }
+    }
+    void grow(const BVHBox& b)
+    {
+        grow(b.lo);
+        grow(b.hi);
+    }
+    float area() const
+    {
+        float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+        return dx < 0 ? 0 : 2 * (dx * dy + dy * dz + dz * dx);
+    }
+};
+
+struct BVHBin
+{
+    BVHBox box;
+    int count;
+};
+
+//the batch rebuilt for ray queries
+struct RayScene
+{
+    const ShadedBatch* batch;
+    vector<RayTriangle> tris;
+    BVH bvh;
+    vector<BVHBox> bounds;      //per triangle
+    vector<float> centroid;     //xyz per triangle
+    unsigned version;           //geometryVersion the tree was built for
+    unsigned moves;             //geometryMoves it was last fit to
+
+    RayScene() : batch(0), version(0), moves(0) {}
+};
+
+RayScene rayScene;
+
+//bounds and centroids of every triangle
+void triangleBounds(RayScene& s)
+{
+    int count = (int)s.tris.size();
+    s.bounds.resize(count);
+    s.centroid.resize(3 * count);
+    parallelFor(count, 4096, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++)
+        {
+            const RayTriangle& t = s.tris[i];
+            float p[3][3] = {
+                { (float)t.a.x, (float)t.a.y, (float)t.a.z },
+                { (float)(t.a.x + t.e1.x), (float)(t.a.y + t.e1.y), (float)(t.a.z + t.e1.z) },
+                { (float)(t.a.x + t.e2.x), (float)(t.a.y + t.e2.y), (float)(t.a.z + t.e2.z) }
+            };
+            BVHBox& b = s.bounds[i];
+            b.empty();
+            for (int k = 0; k < 3; k++)
+                b.grow(p[k]);
+            for (int k = 0; k < 3; k++)
+                s.centroid[3 * i + k] = (b.lo[k] + b.hi[k]) * .5f;
+        }
+    });
+}
+
+//bin the centroids of order[first .. first + count) along all three axes, big
+//ranges are counted by every worker into its own bins and added up after
+void binCentroids(const RayScene& s, const vector<unsigned>& order, int first, int count,
+                  const BVHBox& cbox, BVHBin bins[3][BVH_BINS])
+{
+    int workerCount = workers().size();
+    vector<BVHBin> acc(workerCount * 3 * BVH_BINS);
+    for (size_t i = 0; i < acc.size(); i++)
+    {
+        acc[i].box.empty();
+        acc[i].count = 0;
+    }
+
+    float scale[3];
+    for (int k = 0; k < 3; k++)
+        scale[k] = cbox.hi[k] > cbox.lo[k] ? BVH_BINS / (cbox.hi[k] - cbox.lo[k]) : 0;
+
+    parallelFor(count, 32768, [&](int begin, int end, int worker) {
+        BVHBin* mine = &acc[worker * 3 * BVH_BINS];
+        for (int n = first + begin; n < first + end; n++)
+        {
+            unsigned i = order[n];
+            for (int k = 0; k < 3; k++)
+            {
+                int b = min(BVH_BINS - 1, (int)((s.centroid[3 * i + k] - cbox.lo[k]) * scale[k]));
+                mine[k * BVH_BINS + b].box.grow(s.bounds[i]);
+                mine[k * BVH_BINS + b].count++;
+            }
+        }
+    });
+
+    for (int k = 0; k < 3; k++)
+        for (int b = 0; b < BVH_BINS; b++)
+        {
+            bins[k][b].box.empty();
+            bins[k][b].count = 0;
+            for (int w = 0; w < workerCount; w++)
+            {
+                const BVHBin& from = acc[(w * 3 + k) * BVH_BINS + b];
+                if (from.count)
+                {
+                    bins[k][b].box.grow(from.box);
+                    bins[k][b].count += from.count;
+                }
+            }
+        }
+}
+
+//the box of node ni and, when a split pays for itself, its two children at the
+//end of nodes and on todo
+void splitNode(const RayScene& s, vector<unsigned>& order, vector<BVHNode>& nodes,
+               int ni, int depth, vector<pair<int, int> >& todo)
+{
+    int first = nodes[ni].first, n = nodes[ni].count;
+
+    BVHBox box, cbox;
+    box.empty();
+    cbox.empty();
+    for (int j = first; j < first + n; j++)
+    {
+        box.grow(s.bounds[order[j]]);
+        cbox.grow(&s.centroid[3 * order[j]]);
+    }
+    memcpy(nodes[ni].lo, box.lo, sizeof(box.lo));
+    memcpy(nodes[ni].hi, box.hi, sizeof(box.hi));
+    if (n <= BVH_LEAF || depth >= BVH_DEPTH)
+        return;
+
+    BVHBin bins[3][BVH_BINS];
+    binCentroids(s, order, first, n, cbox, bins);
+
+    //sweep the planes between bins from both ends, cost is area times triangles
+    float bestCost = FLT_MAX;
+    int bestAxis = -1, bestSplit = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        if (cbox.hi[k] <= cbox.lo[k])
+            continue;
+        float rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        BVHBox acc;
+        acc.empty();
+        int c = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--)
+        {
+            if (bins[k][b].count)
+                acc.grow(bins[k][b].box);
+            c += bins[k][b].count;
+            rightArea[b] = acc.area();
+            rightCount[b] = c;
+        }
+        acc.empty();
+        c = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++)
+        {
+            if (bins[k][b].count)
+                acc.grow(bins[k][b].box);
+            c += bins[k][b].count;
+            float cost = acc.area() * c + rightArea[b + 1] * rightCount[b + 1];
+            if (c && rightCount[b + 1] && cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = k;
+                bestSplit = b + 1;
+            }
+        }
+    }
+
+    //one traversal step is worth about one triangle test
+    if (bestAxis < 0 || bestCost / box.area() + 1 >= n)
+        return;
+
+    float lo = cbox.lo[bestAxis], scale = BVH_BINS / (cbox.hi[bestAxis] - lo);
+    unsigned* begin = &order[first];
+    unsigned* mid = partition(begin, begin + n, [&](unsigned i) {
+        return min(BVH_BINS - 1, (int)((s.centroid[3 * i + bestAxis] - lo) * scale)) < bestSplit;
+    });
+    int left = (int)(mid - begin);
+
+    BVHNode l, r;
+    l.first = first;
+    l.count = left;
+    r.first = first + left;
+    r.count = n - left;
+    int children = (int)nodes.size();
+    nodes[ni].first = children;
+    nodes[ni].count = 0;
+    nodes.push_back(l);
+    nodes.push_back(r);
+    todo.push_back(make_pair(children + 1, depth + 1));
+    todo.push_back(make_pair(children, depth + 1));
+}
+
+void buildBVH(RayScene& s)
+{
+    BVH& bvh = s.bvh;
+    int count = (int)s.tris.size();
+    bvh.order.resize(count);
+    for (int i = 0; i < count; i++)
+        bvh.order[i] = i;
+    bvh.nodes.clear();
+    bvh.nodes.reserve(2 * max(1, count / BVH_LEAF) + 1);
+
+    BVHNode root;
+    root.first = 0;
+    root.count = count;
+    bvh.nodes.push_back(root);
+
+    //nodes still to split, the tree grows depth first. the big ones near the
+    //root are split here, the subtrees under BVH_TASK triangles are left for
+    //the workers
+    vector<pair<int, int> > todo(1, make_pair(0, 0));   //node, depth
+    vector<pair<int, int> > subtrees;
+    while (!todo.empty())
+    {
+        int ni = todo.back().first, depth = todo.back().second;
+        todo.pop_back();
+        if (bvh.nodes[ni].count <= BVH_TASK)
+            subtrees.push_back(make_pair(ni, depth));
+        else
+            splitNode(s, bvh.order, bvh.nodes, ni, depth, todo);
+    }
+
+    //each subtree owns its own run of order, so the workers only share reads
+    vector<vector<BVHNode> > built(subtrees.size());
+    workers().run((int)subtrees.size(), [&](int t, int) {
+        vector<BVHNode>& nodes = built[t];
+        nodes.push_back(bvh.nodes[subtrees[t].first]);
+        vector<pair<int, int> > mine(1, make_pair(0, subtrees[t].second));
+        while (!mine.empty())
+        {
+            int ni = mine.back().first, depth = mine.back().second;
+            mine.pop_back();
+            splitNode(s, bvh.order, nodes, ni, depth, mine);
+        }
+    });
+
+    //node 0 of a subtree is the node it was built for, the rest are appended
+    //with their child links moved along
+    for (size_t t = 0; t < built.size(); t++)
+    {
+        const vector<BVHNode>& nodes = built[t];
+        int base = (int)bvh.nodes.size() - 1;
+        for (size_t j = 0; j < nodes.size(); j++)
+        {
+            BVHNode n = nodes[j];
+            if (!n.count)
+                n.first += base;
+            if (j)
+                bvh.nodes.push_back(n);
+            else
+                bvh.nodes[subtrees[t].first] = n;
+        }
+    }
+}
+
+//new bounds for the same tree after the triangles moved, children come after
+//their parent so walking backwards sees them first
+void refitBVH(RayScene& s)
+{
+    BVH& bvh = s.bvh;
+    for (int ni = (int)bvh.nodes.size() - 1; ni >= 0; ni--)
+    {
+        BVHNode& n = bvh.nodes[ni];
+        BVHBox box;
+        box.empty();
+        if (n.count)
+            for (int j = n.first; j < n.first + n.count; j++)
+                box.grow(s.bounds[bvh.order[j]]);
+        else
+            for (int c = 0; c < 2; c++)
+            {
+                box.grow(bvh.nodes[n.first + c].lo);
+                box.grow(bvh.nodes[n.first + c].hi);
+            }
+        memcpy(n.lo, box.lo, sizeof(box.lo));
+        memcpy(n.hi, box.hi, sizeof(box.hi));
+    }
+}
+
+//expected cost of a ray through the tree, node visits and triangle tests
+//weighted by how likely a ray through the root hits each node
+double sahCost(const BVH& bvh)
+{
+    double total = 0, root = 0;
+    for (size_t i = 0; i < bvh.nodes.size(); i++)
+    {
+        BVHBox b;
+        memcpy(b.lo, bvh.nodes[i].lo, sizeof(b.lo));
+        memcpy(b.hi, bvh.nodes[i].hi, sizeof(b.hi));
+        if (i == 0)
+            root = b.area();
+        total += b.area() * (bvh.nodes[i].count ? bvh.nodes[i].count : 1);
+    }
+    return root > 0 ? total / root : 0;
+}
+
+//the batch's triangles for ray queries, the tree is built again only when the
+//geometry changed and refit when just the positions moved
+void buildRayScene(RayScene& s, const ShadedBatch& batch, bool moved = false)
+{
+    bool sameTopology = s.tris.size() == batch.index.size() / 3 && !s.bvh.nodes.empty();
+    moved = moved || s.moves != geometryMoves;
+    s.batch = &batch;
+    if (sameTopology && s.version == geometryVersion && !moved)
+        return;
+
+    s.tris.resize(batch.index.size() / 3);
+    parallelFor((int)s.tris.size(), 4096, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++)
+        {
+            RayTriangle& t = s.tris[i];
+            const unsigned* v = &batch.index[3 * i];
+            t.a = batch.pos[v[0]];
+            t.e1 = Vector3(t.a, batch.pos[v[1]]);
+            t.e2 = Vector3(t.a, batch.pos[v[2]]);
+            memcpy(t.v, v, sizeof(t.v));
+        }
+    });
+    triangleBounds(s);
+    if (sameTopology && s.version == geometryVersion)
+        refitBVH(s);
+    else
+        buildBVH(s);
+    s.version = geometryVersion;
+    s.moves = geometryMoves;
+}
+
+//entry distance of the ray into a node, FLT_MAX when it misses or starts past tmax
+inline Real hitNode(const BVHNode& n, const Real o[3], const Real inv[3], Real tmax)
+{
+    Real t0 = 0, t1 = tmax;
+    for (int k = 0; k < 3; k++)
+    {
+        Real a = (n.lo[k] - o[k]) * inv[k], b = (n.hi[k] - o[k]) * inv[k];
+        t0 = max(t0, min(a, b));
+        t1 = min(t1, max(a, b));
+    }
+    return t0 <= t1 ? t0 : FLT_MAX;
+}
+
+//moller trumbore, both sides count
+bool hitTriangle(Point3 o, const Vector3& d, const RayTriangle& t, Real tmin, Real tmax, RayHit& hit)
+{
+    Vector3 p = d.cross(t.e2);
+    Real det = t.e1.dot(p);
+    if (fabs(det) < 1e-12)
+        return false;
+    Real inv = 1 / det;
+    Vector3 s(t.a, o);
+    Real b1 = s.dot(p) * inv;
+    if (b1 < 0 || b1 > 1)
+        return false;
+    Vector3 q = s.cross(t.e1);
+    Real b2 = d.dot(q) * inv;
+    if (b2 < 0 || b1 + b2 > 1)
+        return false;
+    Real dist = t.e2.dot(q) * inv;
+    if (dist < tmin || dist > tmax)
+        return false;
+    hit.t = dist;
+    hit.b1 = b1;
+    hit.b2 = b2;
+    return true;
+}
+
+//nearest hit in tmin..tmax, or with any set the first one found, nearer child first,
+//start is the node to search from when a ray leaves a packet part way down
+bool traceRay(const RayScene& s, Point3 o, const Vector3& d, Real tmin, Real tmax, RayHit& hit, bool any, int start = 0)
+{
+    const vector<BVHNode>& nodes = s.bvh.nodes;
+    Real o3[3] = { o.x, o.y, o.z }, inv[3] = { 1 / d.x, 1 / d.y, 1 / d.z };
+    if (nodes.empty() || hitNode(nodes[start], o3, inv, tmax) == FLT_MAX)
+        return false;
+
+    int stack[64], top = 0, ni = start;
+    bool found = false;
+    for (;;)
+    {
+        const BVHNode& n = nodes[ni];
+        if (n.count)
+        {
+            for (int j = n.first; j < n.first + n.count; j++)
+            {
+                unsigned k = s.bvh.order[j];
+                if (hitTriangle(o, d, s.tris[k], tmin, tmax, hit))
+                {
+                    hit.tri = (int)k;
+                    tmax = hit.t;
+                    found = true;
+                    if (any)
+                        return true;
+                }
+            }
+        }
+        else
+        {
+            int a = n.first, b = n.first + 1;
+            Real ta = hitNode(nodes[a], o3, inv, tmax), tb = hitNode(nodes[b], o3, inv, tmax);
+            if (tb < ta)
+            {
+                swap(a, b);
+                swap(ta, tb);
+            }
+            if (ta != FLT_MAX)
+            {
+                if (tb != FLT_MAX)
+                    stack[top++] = b;
+                ni = a;
+                continue;
+            }
+        }
+
+        //the next node on the stack the ray can still reach before tmax
+        for (;;)
+        {
+            if (top == 0)
+                return found;
+            ni = stack[--top];
+            if (hitNode(nodes[ni], o3, inv, tmax) != FLT_MAX)
+                break;
+        }
+    }
+}
+
+//ray packets --------------------------------------
+//primary rays of a 4x4 pixel block, or the shadow rays of those pixels toward one
+//light, go down the tree together as four sse groups of four. a node is first
+//tested against the interval of all the packet's origins and directions, a cheap
+//frustum that throws it away for all sixteen rays at once, then group by group.
+//once only a couple of rays are still live below a node they finish alone, and a
+//packet whose directions don't agree in sign is traced as single rays from the start
+
+const int PACKET_GROUPS = 4;
+const int PACKET_RAYS = 4 * PACKET_GROUPS;
+const int PACKET_SPLIT = 2;     //this few live rays go on as single rays
+
+struct RayPacket
+{
+    Point3 o[PACKET_RAYS];
+    Vector3 d[PACKET_RAYS];
+    Real tmin[PACKET_RAYS], tmax[PACKET_RAYS];  //tmax below tmin leaves a ray out
+    RayHit hit[PACKET_RAYS];
+    bool found[PACKET_RAYS];
+};
+
+#ifdef LIGHT_SSE2
+//the packet rearranged for sse, lane l of group g is ray 4 g + l
+struct PacketLanes
+{
+    __m128 o[PACKET_GROUPS][3], d[PACKET_GROUPS][3], inv[PACKET_GROUPS][3];
+    __m128 tmin[PACKET_GROUPS], tmax[PACKET_GROUPS];
+    float olo[3], ohi[3], ilo[3], ihi[3];   //bounds over every live ray
+    float reach;                            //the farthest tmax, it only shrinks
+    int pending;                            //rays still looking, bit per ray
+};
+
+//false when the directions disagree in sign or one of them is flat along an axis
+bool packLanes(const RayPacket& p, PacketLanes& l)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        l.olo[k] = l.ilo[k] = FLT_MAX;
+        l.ohi[k] = l.ihi[k] = -FLT_MAX;
+    }
+
+    float o[3][PACKET_RAYS], d[3][PACKET_RAYS], inv[3][PACKET_RAYS], tmin[PACKET_RAYS], tmax[PACKET_RAYS];
+    l.reach = 0;
+    l.pending = 0;
+    for (int r = 0; r < PACKET_RAYS; r++)
+    {
+        float ro[3] = { (float)p.o[r].x, (float)p.o[r].y, (float)p.o[r].z };
+        float rd[3] = { (float)p.d[r].x, (float)p.d[r].y, (float)p.d[r].z };
+        tmin[r] = (float)p.tmin[r];
+        tmax[r] = (float)p.tmax[r];
+        if (tmax[r] >= tmin[r])
+        {
+            l.reach = max(l.reach, tmax[r]);
+            l.pending |= 1 << r;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            o[k][r] = ro[k];
+            d[k][r] = rd[k];
+            inv[k][r] = 1 / rd[k];
+            if (tmax[r] < tmin[r])
+                continue;
+            if (rd[k] == 0)
+                return false;
+            l.olo[k] = min(l.olo[k], ro[k]);
+            l.ohi[k] = max(l.ohi[k], ro[k]);
+            l.ilo[k] = min(l.ilo[k], inv[k][r]);
+            l.ihi[k] = max(l.ihi[k], inv[k][r]);
+        }
+    }
+    for (int k = 0; k < 3; k++)
+        if (l.ilo[k] < 0 && l.ihi[k] > 0)
+            return false;
+
+    for (int g = 0; g < PACKET_GROUPS; g++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            l.o[g][k] = _mm_loadu_ps(&o[k][4 * g]);
+            l.d[g][k] = _mm_loadu_ps(&d[k][4 * g]);
+            l.inv[g][k] = _mm_loadu_ps(&inv[k][4 * g]);
+        }
+        l.tmin[g] = _mm_loadu_ps(&tmin[4 * g]);
+        l.tmax[g] = _mm_loadu_ps(&tmax[4 * g]);
+    }
+    return true;
+}
+
+//true when no ray of the packet can enter the node, from interval bounds on
+//(plane - origin) / direction, the near plane is the one the directions face
+inline bool packetMisses(const BVHNode& n, const PacketLanes& l, float tmax)
+{
+    float t0 = 0, t1 = tmax;
+    for (int k = 0; k < 3; k++)
+    {
+        float nearPlane = l.ilo[k] > 0 ? n.lo[k] : n.hi[k], farPlane = l.ilo[k] > 0 ? n.hi[k] : n.lo[k];
+        float a0 = (nearPlane - l.olo[k]) * l.ilo[k], a1 = (nearPlane - l.olo[k]) * l.ihi[k];
+        float a2 = (nearPlane - l.ohi[k]) * l.ilo[k], a3 = (nearPlane - l.ohi[k]) * l.ihi[k];
+        float b0 = (farPlane - l.olo[k]) * l.ilo[k], b1 = (farPlane - l.olo[k]) * l.ihi[k];
+        float b2 = (farPlane - l.ohi[k]) * l.ilo[k], b3 = (farPlane - l.ohi[k]) * l.ihi[k];
+        t0 = max(t0, min(min(a0, a1), min(a2, a3)));
+        t1 = min(t1, max(max(b0, b1), max(b2, b3)));
+    }
+    return t0 > t1;
+}
+
+//slab test of one group against a node, bit l set when lane l enters it
+inline int hitNode4(const BVHNode& n, const PacketLanes& l, int g)
+{
+    __m128 t0 = l.tmin[g], t1 = l.tmax[g];
+    for (int k = 0; k < 3; k++)
+    {
+        __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo[k]), l.o[g][k]), l.inv[g][k]);
+        __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi[k]), l.o[g][k]), l.inv[g][k]);
+        t0 = _mm_max_ps(t0, _mm_min_ps(a, b));
+        t1 = _mm_min_ps(t1, _mm_max_ps(a, b));
+    }
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+//moller trumbore for the four lanes of a group in mask, same steps as hitTriangle
+inline void hitTriangle4(const RayTriangle& t, unsigned id, RayPacket& p, PacketLanes& l, int g, int mask)
+{
+    __m128 e1[3] = { _mm_set1_ps((float)t.e1.x), _mm_set1_ps((float)t.e1.y), _mm_set1_ps((float)t.e1.z) };
+    __m128 e2[3] = { _mm_set1_ps((float)t.e2.x), _mm_set1_ps((float)t.e2.y), _mm_set1_ps((float)t.e2.z) };
+    const __m128* d = l.d[g];
+    __m128 s[3] = { _mm_sub_ps(l.o[g][0], _mm_set1_ps((float)t.a.x)),
+                    _mm_sub_ps(l.o[g][1], _mm_set1_ps((float)t.a.y)),
+                    _mm_sub_ps(l.o[g][2], _mm_set1_ps((float)t.a.z)) };
+
+    //p = d x e2, q = s x e1
+    __m128 pv[3] = { _mm_sub_ps(_mm_mul_ps(d[1], e2[2]), _mm_mul_ps(d[2], e2[1])),
+                     _mm_sub_ps(_mm_mul_ps(d[2], e2[0]), _mm_mul_ps(d[0], e2[2])),
+                     _mm_sub_ps(_mm_mul_ps(d[0], e2[1]), _mm_mul_ps(d[1], e2[0])) };
+    __m128 q[3] = { _mm_sub_ps(_mm_mul_ps(s[1], e1[2]), _mm_mul_ps(s[2], e1[1])),
+                    _mm_sub_ps(_mm_mul_ps(s[2], e1[0]), _mm_mul_ps(s[0], e1[2])),
+                    _mm_sub_ps(_mm_mul_ps(s[0], e1[1]), _mm_mul_ps(s[1], e1[0])) };
+    #define DOT3(a, b) _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]))
+    __m128 det = DOT3(e1, pv);
+    __m128 inv = _mm_div_ps(_mm_set1_ps(1), det);
+    __m128 b1 = _mm_mul_ps(DOT3(s, pv), inv);
+    __m128 b2 = _mm_mul_ps(DOT3(d, q), inv);
+    __m128 dist = _mm_mul_ps(DOT3(e2, q), inv);
+    #undef DOT3
+
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 ok = _mm_cmpge_ps(absDet, _mm_set1_ps(1e-12f));
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(b1, zero), _mm_cmple_ps(b1, one)));
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(b2, zero), _mm_cmple_ps(_mm_add_ps(b1, b2), one)));
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(dist, l.tmin[g]), _mm_cmple_ps(dist, l.tmax[g])));
+    int hits = _mm_movemask_ps(ok) & mask;
+    if (!hits)
+        return;
+
+    float bt[4], bb1[4], bb2[4];
+    _mm_storeu_ps(bt, dist);
+    _mm_storeu_ps(bb1, b1);
+    _mm_storeu_ps(bb2, b2);
+    __m128 hitMask = _mm_castsi128_ps(_mm_set_epi32(hits & 8 ? -1 : 0, hits & 4 ? -1 : 0, hits & 2 ? -1 : 0, hits & 1 ? -1 : 0));
+    l.tmax[g] = _mm_or_ps(_mm_and_ps(hitMask, dist), _mm_andnot_ps(hitMask, l.tmax[g]));
+    for (int lane = 0; lane < 4; lane++)
+        if (hits & (1 << lane))
+        {
+            int r = 4 * g + lane;
+            p.hit[r].t = bt[lane];
+            p.hit[r].b1 = bb1[lane];
+            p.hit[r].b2 = bb2[lane];
+            p.hit[r].tri = (int)id;
+            p.found[r] = true;
+            p.tmax[r] = bt[lane];
+        }
+}
+
+//leave every ray in bits out of the rest of the traversal, any hit rays are done once they hit
+inline void retireRays(PacketLanes& l, int bits)
+{
+    l.pending &= ~bits;
+    for (int g = 0; g < PACKET_GROUPS; g++)
+    {
+        int m = (bits >> (4 * g)) & 15;
+        if (!m)
+            continue;
+        __m128 gone = _mm_castsi128_ps(_mm_set_epi32(m & 8 ? -1 : 0, m & 4 ? -1 : 0, m & 2 ? -1 : 0, m & 1 ? -1 : 0));
+        l.tmax[g] = _mm_or_ps(_mm_and_ps(gone, _mm_set1_ps(-FLT_MAX)), _mm_andnot_ps(gone, l.tmax[g]));
+    }
+}
+#endif
+
+//every ray of the packet with its hit in p.hit and p.found, tmax of a ray that hit
+//comes back as its distance
+void tracePacket(const RayScene& s, RayPacket& p, bool any)
+{
+    for (int r = 0; r < PACKET_RAYS; r++)
+        p.found[r] = false;
+
+#ifdef LIGHT_SSE2
+    PacketLanes l;
+    const vector<BVHNode>& nodes = s.bvh.nodes;
+    if (!nodes.empty() && packLanes(p, l))
+    {
+        int stack[64], top = 0, ni = 0;
+        for (;;)
+        {
+            const BVHNode& n = nodes[ni];
+            int live = 0;
+            if (!packetMisses(n, l, l.reach))
+                for (int g = 0; g < PACKET_GROUPS; g++)
+                    if ((l.pending >> (4 * g)) & 15)
+                        live |= hitNode4(n, l, g) << (4 * g);
+            live &= l.pending;
+
+            int count = 0;
+            for (int bits = live; bits; bits &= bits - 1)
+                count++;
+
+            if (count && count <= PACKET_SPLIT)
+            {
+                //too few left to share the work, finish them one at a time below here
+                for (int r = 0; r < PACKET_RAYS; r++)
+                    if (live & (1 << r))
+                    {
+                        RayHit hit;
+                        if (traceRay(s, p.o[r], p.d[r], p.tmin[r], p.tmax[r], hit, any, ni))
+                        {
+                            p.hit[r] = hit;
+                            p.found[r] = true;
+                            p.tmax[r] = hit.t;
+                            float* lane = (float*)&l.tmax[r / 4];
+                            lane[r % 4] = (float)hit.t;
+                            if (any)
+                                retireRays(l, 1 << r);
+                        }
+                    }
+            }
+            else if (count && n.count)
+            {
+                for (int j = n.first; j < n.first + n.count; j++)
+                {
+                    unsigned k = s.bvh.order[j];
+                    for (int g = 0; g < PACKET_GROUPS; g++)
+                        if ((live >> (4 * g)) & 15)
+                            hitTriangle4(s.tris[k], k, p, l, g, (live >> (4 * g)) & 15);
+                }
+                if (any)
+                {
+                    int done = 0;
+                    for (int r = 0; r < PACKET_RAYS; r++)
+                        if (p.found[r])
+                            done |= 1 << r;
+                    retireRays(l, done);
+                }
+            }
+            else if (count)
+            {
+                //the child nearer the middle of the packet's origins first
+                int a = n.first, b = n.first + 1;
+                float da = 0, db = 0;
+                for (int k = 0; k < 3; k++)
+                {
+                    float mid = (l.olo[k] + l.ohi[k]) * .5f;
+                    float ca = (nodes[a].lo[k] + nodes[a].hi[k]) * .5f - mid, cb = (nodes[b].lo[k] + nodes[b].hi[k]) * .5f - mid;
+                    da += ca * ca;
+                    db += cb * cb;
+                }
+                if (db < da)
+                    swap(a, b);
+                stack[top++] = b;
+                ni = a;
+                continue;
+            }
+
+            if (top == 0 || !l.pending)
+                return;
+            ni = stack[--top];
+        }
+    }
+#endif
+
+    for (int r = 0; r < PACKET_RAYS; r++)
+        if (p.tmax[r] >= p.tmin[r] && traceRay(s, p.o[r], p.d[r], p.tmin[r], p.tmax[r], p.hit[r], any))
+        {
+            p.found[r] = true;
+            p.tmax[r] = p.hit[r].t;
+        }
+}
+
+//the shading side of a hit, the normal turned toward the ray and a start point
+//for rays leaving the surface just off it
+struct SurfacePoint
+{
+    Point3 p, from;
+    Vector3 m;
+    const Material* mat;
+};
+
+void surfaceAt(const RayScene& s, Point3 o, const Vector3& d, const RayHit& hit, SurfacePoint& sp)
+{
+    const ShadedBatch& batch = *s.batch;
+    const RayTriangle& t = s.tris[hit.tri];
+    sp.p = pointAlong(o, d, hit.t);
+    sp.m = batch.normal[t.v[0]] * (1 - hit.b1 - hit.b2) + batch.normal[t.v[1]] * hit.b1 + batch.normal[t.v[2]] * hit.b2;
+    sp.m.normalize();
+    //the side the ray came from, meshes may be open
+    Vector3 g = t.e1.cross(t.e2);
+    if (g.dot(d) > 0)
+        g = -g;
+    if (sp.m.dot(d) > 0)
+        sp.m = -sp.m;
+    g.normalize();
+    sp.from = pointAlong(sp.p, g, 1e-3);
+    sp.mat = &batch.materials[batch.materialId[t.v[0]]];
+}
+
+//light() calls of the rays traced for one tile, added to the metrics once
+//the tile is done. pows are counted the way pickKernel counts them for the
+//rasterizer, phong materials without a table
+struct RayLightCalls
+{
+    unsigned long long calls, pows;
+
+    RayLightCalls() : calls(0), pows(0) {}
+    void add(const Material& mat, int count)
+    {
+        calls += count;
+        if (!findBRDF(mat) && !matteMaterial(mat))
+            pows += count;
+    }
+    void report() const
+    {
+        countMetric(METRIC_LIGHT_CALLS, calls);
+        countMetric(METRIC_POW_CALLS, pows);
+    }
+};
+
+void shadeRay(const RayScene& s, Point3 o, const Vector3& d, Real tmin, int depth, RayLightCalls& calls, float rgba[4]);
+
+//light a surface point with the lights it can see and add the mirror bounce
+void shadeSurface(const RayScene& s, Point3 o, const Vector3& d, const SurfacePoint& sp,
+                  const PointLight* visible, int count, int depth, RayLightCalls& calls, float rgba[4])
+{
+    float amb[3];
+    shadePoint(sp.p, sp.m, o, *sp.mat, visible, count, ambientLight(sp.m, amb), rgba);
+    calls.add(*sp.mat, count);
+
+    if (depth + 1 >= RAY_DEPTH)
+        return;
+    Vector3 v = -d;
+    v.normalize();
+    float bounce[4];
+    shadeRay(s, sp.from, getR(v, sp.m), 0, depth + 1, calls, bounce);
+    for (int i = 0; i < 3; i++)
+        rgba[i] += (float)(MIRROR * sp.mat->Ps[i]) * bounce[i];
+}
+
+inline void background(float rgba[4])
+{
+    rgba[0] = rgba[1] = rgba[2] = .5f;
+    rgba[3] = 1;
+}
+
+//radiance back along d from o, tmin keeps primary rays past the near plane
+//like the rasterizer and bounced rays off the surface they left
+void shadeRay(const RayScene& s, Point3 o, const Vector3& d, Real tmin, int depth, RayLightCalls& calls, float rgba[4])
+{
+    const ShadedBatch& batch = *s.batch;
+    RayHit hit;
+    if (!traceRay(s, o, d, tmin, FLT_MAX, hit, false))
+    {
+        background(rgba);
+        return;
+    }
+    SurfacePoint sp;
+    surfaceAt(s, o, d, hit, sp);
+
+    //only the lights the point can see
+    vector<PointLight> visible(batch.lights.size());
+    int count = 0;
+    for (size_t i = 0; i < batch.lights.size(); i++)
+    {
+        RayHit blocker;
+        if (inRange(batch.lights[i], sp.p) && !traceRay(s, sp.from, Vector3(sp.from, batch.lights[i].pos), 0, 1, blocker, true))
+            visible[count++] = batch.lights[i];
+    }
+    shadeSurface(s, o, d, sp, visible.data(), count, depth, calls, rgba);
+}
+
+//progressive refinement ---------------------------
+//while the view moves the ray tracer only traces every PROGRESSIVE_STRIDE-th
+//pixel each way and spreads each one over its block. once it stops, every idle
+//frame halves the stride and traces just the pixels the coarser passes left
+//out, so nothing traced is thrown away until the view changes again
+
+const int PROGRESSIVE_STRIDE = 4;   //power of two, TILE_SIZE has to be a multiple of 4 times it
+bool progressive = true;
+
+class Progress
+{
+    public:
+        Progress() : stride(0), w(0), h(0), lights(0) {}
+
+        //start over from the coarsest pass, the view or the scene changed
+        void restart() { stride = 0; }
+
+        //the frame about to be drawn, a different size or light count starts over
+        void frame(int ww, int hh, int lightCount)
+        {
+            if (ww != w || hh != h || lightCount != lights)
+                restart();
+            w = ww;
+            h = hh;
+            lights = lightCount;
+        }
+
+        bool done() const { return stride == 1; }
+
+        //stride of the next pass, a pass below PROGRESSIVE_STRIDE refines the one before it
+        int next()
+        {
+            stride = stride ? max(1, stride / 2) : PROGRESSIVE_STRIDE;
+            return stride;
+        }
+
+    private:
+        int stride;     //of the last pass drawn, 0 when the next one starts over
+        int w, h, lights;
+};
+
+Progress progress;
+
+//a pass over every step-th pixel that refines the pass before it leaves out
+//the pixels that pass already traced
+inline bool traced(int x, int y, int step, bool refine)
+{
+    return refine && x % (2 * step) == 0 && y % (2 * step) == 0;
+}
+
+//one traced pixel stands in for the step x step block it starts
+template <class Target>
+void putBlock(Target& fb, int x, int y, int step, const float rgba[4])
+{
+    for (int j = y; j < min(y + step, fb.h); j++)
+        for (int i = x; i < min(x + step, fb.w); i++)
+            fb.put(i, j, rgba);
+}
+
+//the 4x4 samples step pixels apart from x, y as one packet of primary rays and
+//one shadow packet per light
+template <class Target>
+void shadeBlock(const RayScene& s, const Camera& c, int x, int y, int step, bool refine, RayLightCalls& calls, Target& fb)
+{
+    const ShadedBatch& batch = *s.batch;
+    RayPacket p;
+    bool wanted[PACKET_RAYS];
+    for (int r = 0; r < PACKET_RAYS; r++)
+    {
+        int px = x + r % 4 * step, py = y + r / 4 * step;
+        wanted[r] = px < fb.w && py < fb.h && !traced(px, py, step, refine);
+        p.o[r] = c.eye;
+        p.d[r] = pixelDirection(c, min(px, fb.w - 1), min(py, fb.h - 1), fb.w, fb.h);
+        p.tmin[r] = (Real)c.nearDist;
+        p.tmax[r] = wanted[r] ? FLT_MAX : -FLT_MAX;
+    }
+    tracePacket(s, p, false);
+
+    SurfacePoint sp[PACKET_RAYS];
+    bool hit[PACKET_RAYS];
+    for (int r = 0; r < PACKET_RAYS; r++)
+    {
+        hit[r] = p.found[r];
+        if (hit[r])
+            surfaceAt(s, p.o[r], p.d[r], p.hit[r], sp[r]);
+    }
+
+    //which lights each hit point sees, one shadow packet per light, points out of a light's range don't ask
+    int lights = (int)batch.lights.size();
+    vector<char> sees(PACKET_RAYS * lights);    //ray r, light i at r * lights + i
+    for (int i = 0; i < lights; i++)
+    {
+        RayPacket shadow;
+        for (int r = 0; r < PACKET_RAYS; r++)
+        {
+            shadow.o[r] = hit[r] ? sp[r].from : c.eye;
+            shadow.d[r] = Vector3(shadow.o[r], batch.lights[i].pos);
+            shadow.tmin[r] = 0;
+            sees[r * lights + i] = hit[r] && inRange(batch.lights[i], sp[r].p);
+            shadow.tmax[r] = sees[r * lights + i] ? 1 : -FLT_MAX;
+        }
+        tracePacket(s, shadow, true);
+        for (int r = 0; r < PACKET_RAYS; r++)
+            sees[r * lights + i] = sees[r * lights + i] && !shadow.found[r];
+    }
+
+    vector<PointLight> visible(lights);
+    for (int r = 0; r < PACKET_RAYS; r++)
+    {
+        if (!wanted[r])
+            continue;
+        float rgba[4];
+        if (!hit[r])
+            background(rgba);
+        else
+        {
+            int count = 0;
+            for (int i = 0; i < lights; i++)
+                if (sees[r * lights + i])
+                    visible[count++] = batch.lights[i];
+            shadeSurface(s, p.o[r], p.d[r], sp[r], visible.data(), count, 0, calls, rgba);
+        }
+        putBlock(fb, x + r % 4 * step, y + r / 4 * step, step, rgba);
+    }
+}
+
+bool rayPackets = true;
+
+//trace every step-th pixel of the view into fb, one tile per task, refine
+//keeps the pixels the pass at twice the step traced
+template <class Target>
+void traceScene(const ShadedBatch& batch, const Camera& c, Target& fb, int step = 1, bool refine = false)
+{
+    buildRayScene(rayScene, batch);
+    int tilesX = (fb.w + TILE_SIZE - 1) / TILE_SIZE, tilesY = (fb.h + TILE_SIZE - 1) / TILE_SIZE;
+    workers().run(tilesX * tilesY, [&](int tile, int) {
+        int ox = (tile % tilesX) * TILE_SIZE, oy = (tile / tilesX) * TILE_SIZE;
+        int ex = min(ox + TILE_SIZE, fb.w), ey = min(oy + TILE_SIZE, fb.h);
+        RayLightCalls calls;
+        if (rayPackets)
+        {
+            for (int y = oy; y < ey; y += 4 * step)
+                for (int x = ox; x < ex; x += 4 * step)
+                    shadeBlock(rayScene, c, x, y, step, refine, calls, fb);
+            calls.report();
+            return;
+        }
+        for (int y = oy; y < ey; y += step)
+            for (int x = ox; x < ex; x += step)
+            {
+                if (traced(x, y, step, refine))
+                    continue;
+                float rgba[4];
+                shadeRay(rayScene, c.eye, pixelDirection(c, x, y, fb.w, fb.h), c.nearDist, 0, calls, rgba);
+                putBlock(fb, x, y, step, rgba);
+            }
+        calls.report();
+    });
+}
+
+//primary rays for the start view at twice the window size and shadow rays from
+//their hits toward the sun, the batch's first light, one at a time and as packets
+int benchPackets(const ShadedBatch& batch, const Camera& c)
+{
+    buildRayScene(rayScene, batch);
+    const RayScene& s = rayScene;
+    int w = 2 * VIEW_W, h = 2 * VIEW_H, blocksX = (w + 3) / 4, blocksY = (h + 3) / 4;
+    int rays = w * h;
+
+    //the hit points the shadow rays start from
+    vector<Point3> from(rays);
+    vector<char> lit(rays);
+    parallelFor(h, 1, [&](int begin, int end, int) {
+        for (int y = begin; y < end; y++)
+            for (int x = 0; x < w; x++)
+            {
+                Vector3 d = pixelDirection(c, x, y, w, h);
+                RayHit hit;
+                lit[y * w + x] = traceRay(s, c.eye, d, (Real)c.nearDist, FLT_MAX, hit, false);
+                if (!lit[y * w + x])
+                    continue;
+                SurfacePoint sp;
+                surfaceAt(s, c.eye, d, hit, sp);
+                from[y * w + x] = sp.from;
+            }
+    });
+    double ms[2][2];
+    long long hits[2][2];
+
+    for (int packets = 0; packets < 2; packets++)
+        for (int shadows = 0; shadows < 2; shadows++)
+        {
+            vector<long long> found(workers().size());
+            chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+            parallelFor(blocksY, 1, [&](int begin, int end, int worker) {
+                for (int by = begin; by < end; by++)
+                    for (int bx = 0; bx < blocksX; bx++)
+                    {
+                        RayPacket p;
+                        for (int r = 0; r < PACKET_RAYS; r++)
+                        {
+                            int x = min(4 * bx + r % 4, w - 1), y = min(4 * by + r / 4, h - 1), i = y * w + x;
+                            bool inside = 4 * bx + r % 4 < w && 4 * by + r / 4 < h;
+                            if (shadows)
+                            {
+                                p.o[r] = from[i];
+                                p.d[r] = Vector3(from[i], batch.lights[0].pos);
+                                p.tmin[r] = 0;
+                                p.tmax[r] = inside && lit[i] ? 1 : -FLT_MAX;
+                            }
+                            else
+                            {
+                                p.o[r] = c.eye;
+                                p.d[r] = pixelDirection(c, x, y, w, h);
+                                p.tmin[r] = (Real)c.nearDist;
+                                p.tmax[r] = inside ? FLT_MAX : -FLT_MAX;
+                            }
+                        }
+
+                        if (packets)
+                            tracePacket(s, p, shadows != 0);
+                        else
+                            for (int r = 0; r < PACKET_RAYS; r++)
+                                p.found[r] = p.tmax[r] >= p.tmin[r] &&
+                                             traceRay(s, p.o[r], p.d[r], p.tmin[r], p.tmax[r], p.hit[r], shadows != 0);
+                        for (int r = 0; r < PACKET_RAYS; r++)
+                            found[worker] += p.found[r];
+                    }
+            });
+            ms[packets][shadows] = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+            hits[packets][shadows] = 0;
+            for (size_t i = 0; i < found.size(); i++)
+                hits[packets][shadows] += found[i];
+        }
+
+    long long shadowRays = 0;
+    for (int i = 0; i < rays; i++)
+        shadowRays += lit[i];
+
+    const char* kind[2] = { "primary", "shadow " };
+    long long count[2] = { rays, shadowRays };
+    for (int k = 0; k < 2; k++)
+        cout << kind[k] << ": single " << count[k] / ms[0][k] / 1000 << " Mrays/s, packets "
+             << count[k] / ms[1][k] / 1000 << " Mrays/s (" << ms[0][k] / ms[1][k] << "x), hits "
+             << hits[0][k] << " vs " << hits[1][k] << "\n";
+#ifndef LIGHT_SSE2
+    cout << "no sse2, packets were traced as single rays\n";
+#endif
+    return 0;
+}
+
+//a bumpy sphere of about triangles triangles straight into a batch, times the
+//tree build, a refit after every vertex moved, and closest and any hit rays
+int benchBVH(int triangles)
+{
+    int rings = max(4, (int)sqrt(triangles / 4.0)), segments = 2 * rings;
+    ShadedBatch batch;
+    for (int r = 0; r <= rings; r++)
+        for (int s = 0; s <= segments; s++)
+        {
+            double theta = 3.14159265 * r / rings, phi = 2 * 3.14159265 * s / segments;
+            double radius = 1 + .05 * sin(7 * theta) * cos(9 * phi);
+            batch.pos.push_back(Point3((Real)(radius * sin(theta) * cos(phi)), (Real)(radius * cos(theta)), (Real)(radius * sin(theta) * sin(phi))));
+            batch.normal.push_back(Vector3((Real)(sin(theta) * cos(phi)), (Real)cos(theta), (Real)(sin(theta) * sin(phi))));
+        }
+    for (int r = 0; r < rings; r++)
+        for (int s = 0; s < segments; s++)
+        {
+            unsigned a = r * (segments + 1) + s, b = a + segments + 1;
+            unsigned quad[6] = { a, b, a + 1, a + 1, b, b + 1 };
+            batch.index.insert(batch.index.end(), quad, quad + 6);
+        }
+    int count = (int)batch.index.size() / 3;
+
+    RayScene s;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    buildRayScene(s, batch);
+    double buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+    for (size_t i = 0; i < batch.pos.size(); i++)
+        batch.pos[i].y += (Real).1;
+    t0 = chrono::steady_clock::now();
+    buildRayScene(s, batch, true);
+    double refitMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+    //rays from a shell around the mesh toward random points near its center
+    const int RAYS = 1 << 20;
+    vector<Point3> from(RAYS);
+    vector<Vector3> dir(RAYS);
+    srand(1);
+    for (int i = 0; i < RAYS; i++)
+    {
+        Real u[6];
+        for (int k = 0; k < 6; k++)
+            u[k] = (Real)rand() / RAND_MAX - (Real).5;
+        Vector3 o(u[0], u[1], u[2]);
+        o.normalize();
+        from[i] = Point3(3 * o.x, 3 * o.y + (Real).1, 3 * o.z);
+        dir[i] = Vector3(from[i], Point3(u[3], u[4] + (Real).1, u[5]));
+    }
+
+    double rate[2];
+    long long hits[2];
+    for (int any = 0; any < 2; any++)
+    {
+        vector<long long> found(workers().size());
+        t0 = chrono::steady_clock::now();
+        parallelFor(RAYS, 4096, [&](int begin, int end, int worker) {
+            for (int i = begin; i < end; i++)
+            {
+                RayHit hit;
+                if (traceRay(s, from[i], dir[i], 0, FLT_MAX, hit, any != 0))
+                    found[worker]++;
+            }
+        });
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        rate[any] = RAYS / sec / 1e6;
+        hits[any] = 0;
+        for (size_t w = 0; w < found.size(); w++)
+            hits[any] += found[w];
+    }
+
+    cout << "bvh: " << count << " triangles, " << s.bvh.nodes.size() << " nodes of " << sizeof(BVHNode)
+         << " bytes, sah cost " << sahCost(s.bvh) << ", " << workers().size() << " threads\n";
+    cout << "build " << buildMs << " ms, refit " << refitMs << " ms\n";
+    cout << "closest hit " << rate[0] << " Mrays/s, any hit " << rate[1] << " Mrays/s ("
+         << hits[0] << " of " << RAYS << " rays hit)\n";
+    return hits[0] == hits[1] ? 0 : 1;
+}
+
+//the scene into fb, straight through the rasterizer, by way of the g-buffer or traced
+template <class Target>
+void drawScene(ShadedBatch& batch, const Camera& c, Target& fb, int step = 1, bool refine = false)
+{
+    if (rayTracing)
+    {
+        traceScene(batch, c, fb, step, refine);
+        return;
+    }
+    if (!deferredShading)
+    {
+        drawBatchSoftware(batch, c, fb);
+        return;
+    }
+    gbuffer.resize(fb.w, fb.h, gbufferLayout);
+    gbuffer.clear();
+    drawBatchSoftware(batch, c, gbuffer);
+    deferredLit = lightGBuffer(gbuffer, tileRaster, batch, c, fb);
+}
+
+void reportDeferred(int lights)
+{
+    cout << "deferred: " << deferredLit << " pixels x " << lights << " lights, g-buffer "
+         << (gbufferLayout == GBUFFER_OCTAHEDRAL ? "octahedral" : "float") << " normals, "
+         << gbuffer.bytesPerPixel() << " bytes/pixel\n";
+}
+
+//tone mapping -------------------------------------
+//separate pass after the hdr framebuffer is finished, exposure and the
+//operator squash the radiance into 0..1 and a table does the srgb curve
+
+enum ToneOperator { TONE_REINHARD, TONE_ACES };
+int toneOperator = TONE_ACES;
+float exposure = 1;
+
+//linear 0..1 to srgb bytes, fine enough that neighbouring entries differ by at most one step
+const int SRGB_LUT_SIZE = 4096;
+unsigned char srgbLUT[SRGB_LUT_SIZE];
+
+void buildSrgbLUT()
+{
+    for (int i = 0; i < SRGB_LUT_SIZE; i++)
+    {
+        double c = (double)i / (SRGB_LUT_SIZE - 1);
+        double s = c <= .0031308 ? 12.92 * c : 1.055 * pow(c, 1 / 2.4) - .055;
+        srgbLUT[i] = (unsigned char)(s * 255 + .5);
+    }
+}
+
+//scalar version of the curves, the sse loop below must match it
+float toneCurve(float x)
+{
+    if (toneOperator == TONE_REINHARD)
+        return x / (1 + x);
+    //narkowicz fit of the aces filmic curve
+    return (x * (2.51f * x + .03f)) / (x * (2.43f * x + .59f) + .14f);
+}
+
+unsigned encodeSrgb(const float c[3])
+{
+    unsigned out = 0xff000000;
+    for (int i = 0; i < 3; i++)
+    {
+        float x = min(max(c[i], 0.0f), 1.0f);
+        out |= (unsigned)srgbLUT[(int)(x * (SRGB_LUT_SIZE - 1))] << (8 * i);
+    }
+    return out;
+}
+
+#ifdef LIGHT_SSE2
+//1/x from the approximate reciprocal and one newton step, plenty for a 12 bit table
+inline __m128 fastReciprocal(__m128 x)
+{
+    __m128 r = _mm_rcp_ps(x);
+    return _mm_sub_ps(_mm_add_ps(r, r), _mm_mul_ps(x, _mm_mul_ps(r, r)));
+}
+#endif
+
+//tone map a run of pixels, four at a time turned into r, g and b registers
+void toneMapRow(const float* in, unsigned* out, int count)
+{
+    int i = 0;
+#ifdef LIGHT_SSE2
+    const __m128 exp = _mm_set1_ps(exposure), zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    const __m128 scale = _mm_set1_ps(SRGB_LUT_SIZE - 1);
+    const __m128 a = _mm_set1_ps(2.51f), b = _mm_set1_ps(.03f);
+    const __m128 c = _mm_set1_ps(2.43f), d = _mm_set1_ps(.59f), e = _mm_set1_ps(.14f);
+    bool reinhard = toneOperator == TONE_REINHARD;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 ch[4] = { _mm_loadu_ps(in + 4 * i),     _mm_loadu_ps(in + 4 * i + 4),
+                         _mm_loadu_ps(in + 4 * i + 8), _mm_loadu_ps(in + 4 * i + 12) };
+        _MM_TRANSPOSE4_PS(ch[0], ch[1], ch[2], ch[3]);
+
+        __m128i idx[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m128 x = _mm_max_ps(_mm_mul_ps(ch[k], exp), zero);
+            __m128 y;
+            if (reinhard)
+                y = _mm_mul_ps(x, fastReciprocal(_mm_add_ps(one, x)));
+            else
+                y = _mm_mul_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(a, x), b)),
+                               fastReciprocal(_mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(c, x), d)), e)));
+            idx[k] = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(y, one), scale));
+        }
+
+        //the table lookups themselves stay scalar
+        int r[4], g[4], bl[4];
+        _mm_storeu_si128((__m128i*)r, idx[0]);
+        _mm_storeu_si128((__m128i*)g, idx[1]);
+        _mm_storeu_si128((__m128i*)bl, idx[2]);
+        for (int k = 0; k < 4; k++)
+            out[i + k] = 0xff000000 | srgbLUT[r[k]] | (srgbLUT[g[k]] << 8) | (srgbLUT[bl[k]] << 16);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float c[3];
+        for (int k = 0; k < 3; k++)
+            c[k] = toneCurve(max(in[4 * i + k] * exposure, 0.0f));
+        out[i] = encodeSrgb(c);
+    }
+}
+
+//the whole pass, rows are split across the worker pool
+void toneMap(const HdrFramebuffer& hdr, Framebuffer& out)
+{
+    out.resize(hdr.w, hdr.h);
+    parallelFor(hdr.h, 16, [&](int begin, int end, int) {
+        for (int y = begin; y < end; y++)
+            toneMapRow(&hdr.rgba[4 * y * hdr.w], &out.color[y * hdr.w], hdr.w);
+    });
+}
+
+//time the pass on a 1080p frame of random radiance
+int benchToneMap(int runs)
+{
+    HdrFramebuffer hdr;
+    Framebuffer out;
+    hdr.resize(1920, 1080);
+    srand(1);
+    for (size_t i = 0; i < hdr.rgba.size(); i++)
+        hdr.rgba[i] = 50.0f * rand() / RAND_MAX;
+
+    const char* names[2] = { "reinhard", "aces" };
+    for (int op = TONE_REINHARD; op <= TONE_ACES; op++)
+    {
+        toneOperator = op;
+        toneMap(hdr, out);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int r = 0; r < runs; r++)
+            toneMap(hdr, out);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / runs;
+        cout << "tone map 1920x1080 " << names[op] << ": " << ms << " ms on " << workers().size() << " workers\n";
+    }
+    return 0;
+}
+
+//copy the software framebuffer over the whole viewport
+void blitFramebuffer(const Framebuffer& fb)
+{
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    //a lower resolution frame is stretched back over the viewport
+    //the software image has no depth, keep it out of the depth buffer
+    glDisable(GL_DEPTH_TEST);
+    glRasterPos2f(-1, -1);
+    glPixelZoom((float)VIEW_W / fb.w, (float)VIEW_H / fb.h);
+    glDrawPixels(fb.w, fb.h, GL_RGBA, GL_UNSIGNED_BYTE, &fb.color[0]);
+    glPixelZoom(1, 1);
+    glEnable(GL_DEPTH_TEST);
+
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+//binary ppm from rgba8 pixels with row 0 at the bottom, flipped so the top row comes first
+bool writePPM(const char* path, int w, int h, const unsigned* color)
+{
+    ofstream out(path, ios::binary);
+    if (!out)
+        return false;
+
+    out << "P6\n" << w << " " << h << "\n255\n";
+    vector<unsigned char> row(w * 3);
+    for (int y = h - 1; y >= 0; y--)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            unsigned c = color[y * w + x];
+            row[3 * x]     = c & 255;
+            row[3 * x + 1] = (c >> 8) & 255;
+            row[3 * x + 2] = (c >> 16) & 255;
+        }
+        out.write((const char*)&row[0], row.size());
+    }
+    return (bool)out;
+}
+
+bool writePPM(const char* path, const Framebuffer& fb)
+{
+    return writePPM(path, fb.w, fb.h, &fb.color[0]);
+}
+
+//png checksums, crc over every chunk and adler over the zlib stream
+unsigned crc32(unsigned crc, const unsigned char* data, size_t n)
+{
+    static unsigned table[256];
+    if (!table[1])
+        for (unsigned i = 0; i < 256; i++)
+        {
+            unsigned c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++)
+        crc = table[(crc ^ data[i]) & 255] ^ (crc >> 8);
+    return ~crc;
+}
+
+void putBigEndian(vector<unsigned char>& out, unsigned v)
+{
+    for (int i = 3; i >= 0; i--)
+        out.push_back((v >> (8 * i)) & 255);
+}
+
+void pngChunk(ofstream& out, const char* type, const vector<unsigned char>& data)
+{
+    vector<unsigned char> chunk;
+    putBigEndian(chunk, (unsigned)data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    putBigEndian(chunk, crc32(0, &chunk[4], chunk.size() - 4));
+    out.write((const char*)&chunk[0], chunk.size());
+}
+
+//rgb png, there is no zlib here so the deflate stream uses stored blocks,
+//bigger files than a real compressor but nothing for the writer to wait on
+bool writePNG(const char* path, int w, int h, const unsigned* color)
+{
+    ofstream out(path, ios::binary);
+    if (!out)
+        return false;
+    out.write("\x89PNG\r\n\x1a\n", 8);
+
+    vector<unsigned char> header;
+    putBigEndian(header, w);
+    putBigEndian(header, h);
+    const unsigned char rest[5] = { 8, 2, 0, 0, 0 };   //8 bit rgb, no interlace
+    header.insert(header.end(), rest, rest + 5);
+    pngChunk(out, "IHDR", header);
+
+    //filter byte 0 then the row, top row first
+    vector<unsigned char> raw;
+    raw.reserve((3 * w + 1) * h);
+    for (int y = h - 1; y >= 0; y--)
+    {
+        raw.push_back(0);
+        for (int x = 0; x < w; x++)
+        {
+            unsigned c = color[y * w + x];
+            raw.push_back(c & 255);
+            raw.push_back((c >> 8) & 255);
+            raw.push_back((c >> 16) & 255);
+        }
+    }
+
+    vector<unsigned char> z;
+    z.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    z.push_back(0x78);
+    z.push_back(0x01);
+    unsigned a = 1, b = 0;
+    for (size_t pos = 0, n; pos < raw.size(); pos += n)
+    {
+        n = min((size_t)65535, raw.size() - pos);
+        z.push_back(pos + n == raw.size() ? 1 : 0);
+        z.push_back(n & 255);
+        z.push_back(n >> 8);
+        z.push_back(~n & 255);
+        z.push_back((~n >> 8) & 255);
+        for (size_t i = pos; i < pos + n; i++)
+        {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + n);
+    }
+    putBigEndian(z, (b << 16) | a);
+    pngChunk(out, "IDAT", z);
+    pngChunk(out, "IEND", vector<unsigned char>());
+    return (bool)out;
+}
+
+//frame export -------------------------------------
+//the render thread copies a finished frame into a buffer from a fixed pool
+//and queues it, a writer thread encodes and saves it, when the pool is empty
+//because the writer fell behind the frame is dropped instead of waiting.
+//stopping doesn't wait either, the writer drains the queue and reports on
+//its own, only finish, at exit or before the next start, joins it
+
+class FrameExporter
+{
+    public:
+        FrameExporter(int poolSize = 8);
+        ~FrameExporter();
+
+        void start(const string& prefix, bool png);
+        void stop();
+        void finish();
+        bool active() const { return running; }
+
+        //a free buffer for a w x h frame, 0 means drop this frame
+        vector<unsigned>* acquire(int w, int h);
+        //queue a filled buffer from acquire for the writer
+        void submit(vector<unsigned>* frame, int w, int h);
+
+        void report();
+
+    private:
+        void writer();
+
+        struct Job
+        {
+            vector<unsigned>* pixels;
+            int w, h, number;
+        };
+
+        vector<vector<unsigned> > buffers;
+        vector<vector<unsigned>*> spare;
+        vector<Job> queue;
+        mutex lock;
+        condition_variable ready;
+        thread worker;
+        bool running, quit;
+        string prefix;
+        bool png;
+        int frameNumber;
+        atomic<int> encoded, dropped, failed;
+};
+
+FrameExporter::FrameExporter(int poolSize) : buffers(poolSize), running(false), quit(false),
+    png(false), frameNumber(0), encoded(0), dropped(0), failed(0)
+{
+    for (int i = 0; i < poolSize; i++)
+        spare.push_back(&buffers[i]);
+}
+
+FrameExporter::~FrameExporter()
+{
+    finish();
+}
+
+void FrameExporter::start(const string& p, bool asPng)
+{
+    finish();
+    prefix = p;
+    png = asPng;
+    frameNumber = 0;
+    encoded = dropped = failed = 0;
+    quit = false;
+    running = true;
+    worker = thread(&FrameExporter::writer, this);
+}
+
+//take no more frames, the writer finishes what is queued and leaves
+void FrameExporter::stop()
+{
+    if (!running)
+        return;
+    {
+        lock_guard<mutex> hold(lock);
+        quit = true;
+    }
+    ready.notify_one();
+    running = false;
+}
+
+//stop and wait until everything queued is written
+void FrameExporter::finish()
+{
+    stop();
+    if (worker.joinable())
+        worker.join();
+}
+
+vector<unsigned>* FrameExporter::acquire(int w, int h)
+{
+    lock_guard<mutex> hold(lock);
+    if (spare.empty())
+    {
+        dropped++;
+        frameNumber++;
+        return 0;
+    }
+    vector<unsigned>* frame = spare.back();
+    spare.pop_back();
+    frame->resize(w * h);
+    return frame;
+}
+
+void FrameExporter::submit(vector<unsigned>* frame, int w, int h)
+{
+    {
+        lock_guard<mutex> hold(lock);
+        Job job = { frame, w, h, frameNumber++ };
+        queue.push_back(job);
+    }
+    ready.notify_one();
+}
+
+void FrameExporter::writer()
+{
+    unique_lock<mutex> hold(lock);
+    for (;;)
+    {
+        ready.wait(hold, [&] { return quit || !queue.empty(); });
+        if (queue.empty())
+        {
+            report();
+            return;
+        }
+
+        Job job = queue.front();
+        queue.erase(queue.begin());
+        hold.unlock();
+
+        char name[32];
+        sprintf(name, "_%05d.%s", job.number, png ? "png" : "ppm");
+        string path = prefix + name;
+        bool ok = png ? writePNG(path.c_str(), job.w, job.h, &(*job.pixels)[0])
+                      : writePPM(path.c_str(), job.w, job.h, &(*job.pixels)[0]);
+        if (ok)
+            encoded++;
+        else
+            failed++;
+
+        hold.lock();
+        spare.push_back(job.pixels);
+    }
+}
+
+void FrameExporter::report()
+{
+    cout << "capture " << prefix << ": " << encoded << " frames encoded, " << dropped << " dropped";
+    if (failed)
+        cout << ", " << failed << " failed to write";
+    cout << "\n";
+}
+
+FrameExporter exporter;
+string capturePrefix = "frame";
+bool capturePng = false;
+
+//grab what is in the back buffer before it is swapped, only a copy into the pool
+void captureFrame()
+{
+    if (!exporter.active())
+        return;
+
+    vector<unsigned>* frame = exporter.acquire(VIEW_W, VIEW_H);
+    if (!frame)
+        return;
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, VIEW_W, VIEW_H, GL_RGBA, GL_UNSIGNED_BYTE, &(*frame)[0]);
+    exporter.submit(frame, VIEW_W, VIEW_H);
+}
+
+void drawNumbers()
+{
+
+    //
+    glRasterPos3d(.75, 1.15, 0);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '1');
+
+    //
+    glRasterPos3d(-.75, 1.15, 0);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '2');
+
+    //
+    glRasterPos3d(.75, -1.15, 0);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '3');
+
+    //
+    glRasterPos3d(0, -.65, 1.25);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '4');
+
+    //
+    glRasterPos3d(0, .5, 1.25);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '5');
+
+    //
+    glRasterPos3d(0, .5, -1.25);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '6');
+
+    //
+    glRasterPos3d(0, -.65, -1.25);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '7');
+
+    //
+    glRasterPos3d(-1.20, .10, .75);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '8');
+
+    //
+    glRasterPos3d(-.75, -1.15, 0);
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '9');
+    
+    //
+    string str = "10";
+    glRasterPos3d(1.20, .10, -.60);
+    for (int i = 0; i < 2; i++)
+        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, (int)str[i]);
+
+    //
+    str = "11";
+    glRasterPos3d(-1.20, .10, -.75);
+    for (int i = 0; i < 2; i++)
+        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, (int)str[i]);
+    
+    str = "12";
+    glRasterPos3d(1.20, .10, .60);
+    for (int i = 0; i < 2; i++)
+        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, (int)str[i]);
+    
+}
+  
+Point3 sunShine = Point3(15,20,10);
+bool GS = false;
+
+ShadedBatch frameBatch;
+Framebuffer frameBuffer;
+HdrFramebuffer hdrBuffer;
+
+//copy every mesh into the batch and light its vertices once, the normals were
+//made at load time, without lightVertices the software renderer lights what it draws
+void shadeScene(ShadedBatch& batch, bool lightVertices)
+{
+    updateEnvironment();
+
+    //the sun first, then as many fill lights as the quality level allows
+    batch.lights.clear();
+    PointLight sun = { sunShine, 1, lightRadius };
+    batch.lights.push_back(sun);
+    for (int i = 0; i + 1 < activeLights && i < (int)fillLights.size(); i++)
+        batch.lights.push_back(fillLights[i]);
+    batch.materials = sceneMaterials;
+    if (GS && batch.materials.size() > 1)
+        swap(batch.materials[0], batch.materials[1]);
+    batch.eye = cam.eye;
+    batch.kernels.clear();
+    for (size_t i = 0; i < batch.materials.size(); i++)
+        batch.kernels.push_back(pickKernel(TERMS_FULL, batch.materials[i], &batch.lights[0], (int)batch.lights.size()));
+    checkDiffuseCache(batch);
+
+    batch.clear();
+    for (size_t mi = 0; mi < meshes.size(); mi++)
+    {
+        const Mesh& mesh = meshes[mi];
+        unsigned base = batch.size();
+        int count = (int)mesh.vert.size();
+
+        batch.pos.resize(base + count);
+        batch.normal.resize(base + count);
+        batch.uv.resize(2 * (base + count));
+        batch.tangent.resize(base + count);
+        batch.handedness.resize(base + count);
+        batch.materialId.resize(base + count, (unsigned char)mesh.material);
+        batch.color.resize(4 * (base + count));
+        parallelFor(count, 1024, [&](int begin, int end, int) {
+            for (int i = begin; i < end; i++)
+            {
+                batch.pos[base + i] = mesh.vert[i].p;
+                batch.normal[base + i] = mesh.vert[i].n;
+                batch.uv[2 * (base + i)] = mesh.vert[i].u;
+                batch.uv[2 * (base + i) + 1] = mesh.vert[i].v;
+                batch.tangent[base + i] = mesh.vert[i].t;
+                batch.handedness[base + i] = mesh.vert[i].handedness;
+            }
+        });
+
+        BatchPart part = { (int)mi, base, (unsigned)count, (unsigned)batch.index.size(), (unsigned)mesh.index.size() };
+        batch.parts.push_back(part);
+        for (size_t i = 0; i < mesh.index.size(); i++)
+            batch.index.push_back(base + mesh.index[i]);
+        if (lightVertices)
+            lightPart(batch, (int)mi);
+    }
+}
+
+//orbit the camera around the scene and light every vertex each frame, with
+//the diffuse cache and without, then once more with the sun moving instead,
+//the last run only copies the batch to take that out of the lighting times
+int benchDiffuseCache(int frames)
+{
+    ShadedBatch batch;
+    Point3 sun = sunShine;
+    const char* names[4] = { "camera, no cache", "camera, cache   ", "sun, cache      ", "copy only       " };
+    double ms[4];
+    for (int run = 0; run < 4; run++)
+    {
+        bool lit = run < 3;
+        diffuseCaching = run > 0;
+        batch.cache.hits = batch.cache.misses = 0;
+        shadeScene(batch, lit);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++)
+        {
+            double angle = 2 * 3.14159265 * i / frames;
+            if (run == 2)
+                sunShine = Point3(sun.x + cos(angle), sun.y, sun.z + sin(angle));
+            else
+                cam.set(5 * cos(angle), 3, 5 * sin(angle), 0, 0, 0, 0, 1, 0);
+            shadeScene(batch, lit);
+        }
+        ms[run] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / frames;
+        cout << names[run] << ": " << ms[run] << " ms/frame for " << batch.size() << " vertices";
+        if (lit)
+        {
+            cout << ", ";
+            reportDiffuseCache(batch.cache);
+        }
+        else
+            cout << "\n";
+    }
+    sunShine = sun;
+    cout << "camera moves light the vertices in " << (ms[1] - ms[3]) / (ms[0] - ms[3]) << "x the uncached time\n";
+    return 0;
+}
+
+//quad view ----------------------------------------
+//top, front and side views of the scene next to the camera's own, in one
+//window or one picture. the ambient and diffuse of every vertex is lit once
+//for all four, then each view on its own worker adds the specular seen from
+//its eye, culls against its own pyramid and rasterizes into its own quarter.
+//the ray tracer keeps to the single view
+
+bool quadView = false;
+const float QUAD_FOV = 20;      //narrow, so the fixed views come close to orthographic
+const int QUAD_VIEWS = 4;
+
+struct Viewport
+{
+    const char* name;
+    Camera cam;
+    int x, y, w, h;             //its quarter of the picture, row 0 at the bottom
+    BatchView batch;
+    Framebuffer fb;
+    HdrFramebuffer hdr;
+    GBuffer gbuffer;
+    int deferredLit;
+};
+
+Viewport viewports[QUAD_VIEWS];
+
+bool quadLayout() { return quadView && !rayTracing; }
+
+//where view n goes in a w x h picture, top and front above, side and the camera below
+void quarter(int n, int w, int h, int& x, int& y, int& qw, int& qh)
+{
+    int left = w / 2, bottom = h / 2;
+    x = n % 2 ? left : 0;
+    qw = n % 2 ? w - left : left;
+    y = n < 2 ? bottom : 0;
+    qh = n < 2 ? h - bottom : bottom;
+}
+
+//the fixed views look at the middle of the scene's bounds from far enough
+//away that all of it fits, the last one is the camera itself
+void placeViewports(const Camera& c, int w, int h)
+{
+    Point3 lo(0, 0, 0), hi(0, 0, 0);
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        const Mesh& mesh = meshes[i];
+        if (i == 0)
+        {
+            lo = mesh.lo;
+            hi = mesh.hi;
+            continue;
+        }
+        lo.x = min(lo.x, mesh.lo.x); hi.x = max(hi.x, mesh.hi.x);
+        lo.y = min(lo.y, mesh.lo.y); hi.y = max(hi.y, mesh.hi.y);
+        lo.z = min(lo.z, mesh.lo.z); hi.z = max(hi.z, mesh.hi.z);
+    }
+    Point3 mid((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+    Real radius = max((Real).5, Vector3(lo, hi).magnitude() / 2);
+    Real dist = radius / sin(QUAD_FOV * 3.14159265 / 360);
+
+    //direction to the eye and the up of each fixed view
+    const char* names[QUAD_VIEWS] = { "top", "front", "side", "camera" };
+    const Real axes[3][6] = {
+        { 0, 1, 0,  0, 0, -1 },
+        { 0, 0, 1,  0, 1, 0 },
+        { 1, 0, 0,  0, 1, 0 }
+    };
+    for (int n = 0; n < QUAD_VIEWS; n++)
+    {
+        Viewport& v = viewports[n];
+        v.name = names[n];
+        quarter(n, w, h, v.x, v.y, v.w, v.h);
+        if (n == QUAD_VIEWS - 1)
+        {
+            v.cam = c;
+            continue;
+        }
+        const Real* a = axes[n];
+        v.cam.set(mid.x + a[0] * dist, mid.y + a[1] * dist, mid.z + a[2] * dist, mid.x, mid.y, mid.z, a[3], a[4], a[5]);
+        v.cam.setShape(QUAD_FOV, c.aspect, max((Real).1, (dist - radius) / 2), dist + 2 * radius);
+    }
+}
+
+//drawScene for one view, through its own rasterizer and g-buffer
+template <class Target>
+void drawViewport(ShadedBatch& batch, Viewport& v, Target& fb)
+{
+    if (!deferredShading)
+    {
+        drawBatchSoftware(batch, v.cam, fb, &v.batch);
+        return;
+    }
+    v.gbuffer.resize(fb.w, fb.h, gbufferLayout);
+    v.gbuffer.clear();
+    drawBatchSoftware(batch, v.cam, v.gbuffer, &v.batch);
+    v.deferredLit = lightGBuffer(v.gbuffer, v.batch.raster, batch, v.cam, fb);
+}
+
+//all four views into a w x h fb, the occlusion and deferred numbers are the
+//views' added up. nested parallel loops run inline, so every view keeps to
+//the worker it started on
+void renderQuad(ShadedBatch& batch, const Camera& c, Framebuffer& fb, int w, int h)
+{
+    placeViewports(c, w, h);
+
+    //the view independent half, once for every part whichever views end up seeing it
+    if (!perPixelShading && !deferredShading)
+        for (size_t pi = 0; pi < batch.parts.size(); pi++)
+            diffusePart(batch, (int)pi);
+
+    workers().run(QUAD_VIEWS, [&](int n, int) {
+        Viewport& v = viewports[n];
+        v.batch.color.resize(batch.color.size());
+        v.batch.packed.resize(batch.size());
+        v.deferredLit = 0;
+        if (hdrMode)
+        {
+            const float clear[4] = { .5f, .5f, .5f, 1 };
+            v.hdr.resize(v.w, v.h);
+            v.hdr.clear(clear);
+            drawViewport(batch, v, v.hdr);
+            toneMap(v.hdr, v.fb);
+        }
+        else
+        {
+            v.fb.resize(v.w, v.h);
+            v.fb.clear(CLEAR_COLOR);
+            drawViewport(batch, v, v.fb);
+        }
+    });
+
+    fb.resize(w, h);
+    OcclusionStats total = { 0, 0, 0, 0 };
+    deferredLit = 0;
+    for (int n = 0; n < QUAD_VIEWS; n++)
+    {
+        const Viewport& v = viewports[n];
+        for (int y = 0; y < v.h; y++)
+            memcpy(&fb.color[(v.y + y) * w + v.x], &v.fb.color[y * v.w], v.w * sizeof(unsigned));
+        const OcclusionStats& s = v.batch.raster.stats;
+        total.objects += s.objects;
+        total.objectsRejected += s.objectsRejected;
+        total.triangles += s.triangles;
+        total.trianglesRejected += s.trianglesRejected;
+        deferredLit += v.deferredLit;
+    }
+    tileRaster.stats = total;
+}
+
+//draw the unlit batch on the cpu into fb, through the hdr buffer and tone mapping in hdr mode
+//a progressive ray traced frame only adds a pass to the picture so far, and
+//leaves fb alone once the picture is whole
+void renderSoftware(ShadedBatch& batch, const Camera& c, Framebuffer& fb)
+{
+    int w = max(1, (int)(VIEW_W * renderScale)), h = max(1, (int)(VIEW_H * renderScale));
+    if (quadLayout())
+    {
+        renderQuad(batch, c, fb, w, h);
+        return;
+    }
+    int step = 1;
+    bool refine = false;
+    if (rayTracing && progressive)
+    {
+        progress.frame(w, h, (int)batch.lights.size());
+        if (progress.done())
+            return;
+        step = progress.next();
+        refine = step < PROGRESSIVE_STRIDE;
+    }
+
+    if (hdrMode)
+    {
+        const float clear[4] = { .5f, .5f, .5f, 1 };
+        hdrBuffer.resize(w, h);
+        if (!refine)
+            hdrBuffer.clear(clear);
+        drawScene(batch, c, hdrBuffer, step, refine);
+        toneMap(hdrBuffer, fb);
+    }
+    else
+    {
+        fb.resize(w, h);
+        if (!refine)
+            fb.clear(CLEAR_COLOR);
+        drawScene(batch, c, fb, step, refine);
+    }
+}
+
+//adaptive quality ---------------------------------
+//watches frame times and gives up quality to hold a frame budget, it moves one
+//level at a time, drops and climbs at different thresholds and waits after
+//every move so it doesn't flap between two levels
+
+struct QualityLevel
+{
+    const char* name;
+    bool perPixel;      //per pixel lighting in the software path
+    int lights;         //sun plus fill lights
+    int sphereSlices;   //sun sphere detail
+    float resolution;   //software render scale
+};
+
+const QualityLevel qualityLevels[] = {
+    { "full",   true,  INT_MAX, 20, 1    },
+    { "high",   true,  8,       16, 1    },
+    { "medium", false, 8,       12, 1    },
+    { "low",    false, 4,       10, .75f },
+    { "lowest", false, 1,       8,  .5f  }
+};
+const int QUALITY_LEVELS = sizeof(qualityLevels) / sizeof(qualityLevels[0]);
+
+class QualityController
+{
+    public:
+        QualityController() : budget(1000.0 / 60), current(0), average(0), over(0), under(0), wait(0) {}
+
+        void setBudget(double ms) { budget = ms; }
+        double getBudget() const { return budget; }
+
+        int level() const { return current; }
+        double averageMs() const { return average; }
+
+        //feed one measured frame, true if the level changed
+        bool frame(double ms)
+        {
+            average = average == 0 ? ms : average + (ms - average) * .1;
+            if (wait > 0)
+            {
+                wait--;
+                return false;
+            }
+
+            over  = average > budget * 1.05 ? over + 1 : 0;
+            under = average < budget * .6   ? under + 1 : 0;
+            if (over >= 10 && current + 1 < QUALITY_LEVELS)
+                return moveTo(current + 1);
+            if (under >= 60 && current > 0)
+                return moveTo(current - 1);
+            return false;
+        }
+
+    private:
+        bool moveTo(int level)
+        {
+            current = level;
+            over = under = 0;
+            wait = 30;
+            return true;
+        }
+
+        double budget;      //ms a frame may take
+        int current;        //index into qualityLevels, 0 is best
+        double average;     //smoothed frame time
+        int over, under;    //frames in a row past either threshold
+        int wait;           //frames left before the next move
+};
+
+QualityController quality;
+bool adaptiveQuality = false;
+bool perPixelWanted = false;    //the 'p' setting, quality levels can only take it away
+
+//turn the current level and the user settings into what this frame uses
+void applyQuality()
+{
+    const QualityLevel& q = qualityLevels[adaptiveQuality ? quality.level() : 0];
+    perPixelShading = perPixelWanted && q.perPixel;
+    activeLights = q.lights;
+    sunSlices = q.sphereSlices;
+    renderScale = q.resolution;
+}
+
+//called with how long display took, logs every level change
+void measureFrame(double ms)
+{
+    countFrame(ms);
+    if (adaptiveQuality && quality.frame(ms))
+        cout << "quality: " << qualityLevels[quality.level()].name << " (level " << quality.level()
+             << ", average " << quality.averageMs() << " ms, budget " << quality.getBudget() << " ms)\n";
+}
+
+//a ring of dimmer lights around the cube for many light scenes
+void makeFillLights(int count)
+{
+    fillLights.clear();
+    for (int i = 0; i < count; i++)
+    {
+        double angle = 2 * 3.14159265 * i / count;
+        PointLight l = { Point3(10 * cos(angle), 6 + 4 * sin(3 * angle), 10 * sin(angle)), .3, lightRadius };
+        fillLights.push_back(l);
+    }
+}
+
+//scene files --------------------------------------
+//the start view, the lights, the materials and the objects as text, a line each
+//
+//  camera ex ey ez  lx ly lz  ux uy uz  [fov]
+//  sun x y z
+//  light x y z scale [radius]
+//  material name f Ia Id Is  Pa.r g b  Pd.r g b  Ps.r g b
+//  cube name material x y z [size]
+//  mesh name material file.obj [x y z [size]]
+//
+//# starts a comment, brass and silver are there without a material line and a
+//material has to come before what uses it. when the file is saved it is read
+//again and objects are matched by name, the ones whose line means the same
+//keep their mesh and the diffuse lit for it
+
+struct StartView
+{
+    Real eye[3], look[3], up[3];
+    Real fov;
+};
+
+StartView startView = { { 3, 3, 3 }, { 0, 0, 0 }, { 0, 1, 0 }, 30 };
+
+void placeCamera(const StartView& s)
+{
+    cam.set(s.eye[0], s.eye[1], s.eye[2], s.look[0], s.look[1], s.look[2], s.up[0], s.up[1], s.up[2]);
+    cam.setShape(s.fov, 64.0/48.0, .5, 100.0);
+}
+
+struct SceneObject
+{
+    string name, path;      //no path for a cube
+    int material;
+    Real at[3], size;
+
+    bool operator==(const SceneObject& o) const
+    {
+        return name == o.name && path == o.path && material == o.material &&
+               at[0] == o.at[0] && at[1] == o.at[1] && at[2] == o.at[2] && size == o.size;
+    }
+};
+
+struct SceneFile
+{
+    StartView view;
+    Point3 sun;
+    vector<PointLight> lights;
+    vector<Material> materials;
+    vector<string> materialNames;
+    vector<SceneObject> objects;
+};
+
+string scenePath;
+SceneFile sceneFile;        //the last read that parsed
+bool sceneLoaded = false;
+int sceneMeshes = 0;        //meshes[0 .. sceneMeshes) are its objects, the ones after came from the command line
+vector<string> sceneTopology;   //topologyKey of each of them
+
+//skips blanks, false at the end of the line or at a comment
+bool moreOnLine(const char*& p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        p++;
+    return *p && *p != '\n' && *p != '#';
+}
+
+string sceneWord(const char*& p)
+{
+    if (!moreOnLine(p))
+        return string();
+    const char* start = p;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        p++;
+    return string(start, p);
+}
+
+//up to count numbers, how many there were
+int sceneNumbers(const char*& p, Real* out, int count)
+{
+    int n = 0;
+    while (n < count && moreOnLine(p))
+    {
+        char* end;
+        double v = strtod(p, &end);
+        if (end == p)
+            break;
+        out[n++] = (Real)v;
+        p = end;
+    }
+    return n;
+}
+
+//text into f, the first mistake is printed with its line and fails the whole file
+bool parseScene(const string& text, const string& name, SceneFile& f)
+{
+    f.view = { { 3, 3, 3 }, { 0, 0, 0 }, { 0, 1, 0 }, 30 };
+    f.sun = Point3(15, 20, 10);
+    f.materials.assign(1, brass);
+    f.materials.push_back(silver);
+    f.materialNames.assign(1, "brass");
+    f.materialNames.push_back("silver");
+
+    unordered_map<string, int> names;
+    const char* p = text.c_str();
+    for (int line = 1; *p; line++)
+    {
+        string what = sceneWord(p), error;
+        Real v[13];
+        if (what.empty())
+            ;
+        else if (what == "camera")
+        {
+            int n = sceneNumbers(p, v, 10);
+            if (n < 9)
+                error = "camera needs eye, look and up";
+            else
+                f.view = { { v[0], v[1], v[2] }, { v[3], v[4], v[5] }, { v[6], v[7], v[8] }, n > 9 ? v[9] : 30 };
+        }
+        else if (what == "sun")
+        {
+            if (sceneNumbers(p, v, 3) < 3)
+                error = "sun needs x y z";
+            else
+                f.sun = Point3(v[0], v[1], v[2]);
+        }
+        else if (what == "light")
+        {
+            int n = sceneNumbers(p, v, 5);
+            if (n < 4)
+                error = "light needs x y z scale";
+            else
+            {
+                PointLight l = { Point3(v[0], v[1], v[2]), v[3], n > 4 ? v[4] : lightRadius };
+                f.lights.push_back(l);
+            }
+        }
+        else if (what == "material")
+        {
+            string m = sceneWord(p);
+            if (m.empty() || sceneNumbers(p, v, 13) < 13)
+                error = "material needs a name, f, Ia Id Is and the Pa Pd Ps colors";
+            else
+            {
+                Material mat = { v[0], v[1], v[2], v[3], { v[4], v[5], v[6] }, { v[7], v[8], v[9] }, { v[10], v[11], v[12] } };
+                size_t i = find(f.materialNames.begin(), f.materialNames.end(), m) - f.materialNames.begin();
+                if (i == f.materials.size())
+                {
+                    f.materials.push_back(mat);
+                    f.materialNames.push_back(m);
+                }
+                else
+                    f.materials[i] = mat;
+                if (f.materials.size() > 256)
+                    error = "more than 256 materials";
+            }
+        }
+        else if (what == "cube" || what == "mesh")
+        {
+            SceneObject o;
+            o.name = sceneWord(p);
+            string m = sceneWord(p);
+            if (what == "mesh")
+                o.path = sceneWord(p);
+            o.material = (int)(find(f.materialNames.begin(), f.materialNames.end(), m) - f.materialNames.begin());
+            int n = sceneNumbers(p, v, 4);
+            for (int k = 0; k < 3; k++)
+                o.at[k] = n >= 3 ? v[k] : 0;
+            o.size = n > 3 ? v[3] : 1;
+
+            if (o.name.empty() || m.empty() || (what == "mesh" && o.path.empty()))
+                error = what == "cube" ? "cube needs a name, a material and x y z" : "mesh needs a name, a material and a file";
+            else if (what == "cube" ? n < 3 : n != 0 && n < 3)
+                error = "an object's position needs x y z";
+            else if (o.material == (int)f.materials.size())
+                error = "no material " + m;
+            else if (!names.insert(make_pair(o.name, (int)f.objects.size())).second)
+                error = "a second object called " + o.name;
+            else
+                f.objects.push_back(o);
+        }
+        else
+            error = "don't know " + what;
+
+        if (error.empty() && moreOnLine(p))
+            error = "too much on the line";
+        if (!error.empty())
+        {
+            cout << name << ":" << line << ": " << error << "\n";
+            return false;
+        }
+        while (*p && *p++ != '\n')
+            ;
+    }
+    return true;
+}
+
+//a copy of the cube or a loaded mesh scaled and moved to where the object is
+void placeObject(Mesh& mesh, const SceneObject& o)
+{
+    for (size_t i = 0; i < mesh.vert.size(); i++)
+    {
+        Point3& p = mesh.vert[i].p;
+        p = Point3(p.x * o.size + o.at[0], p.y * o.size + o.at[1], p.z * o.size + o.at[2]);
+    }
+    mesh.name = o.name;
+    mesh.material = o.material;
+    buildBounds(mesh);
+}
+
+//what the triangles of an object depend on, a new position or size keeps it
+string topologyKey(const SceneObject& o, const Mesh& mesh)
+{
+    return o.name + '\n' + o.path + '\n' + to_string(mesh.triangles());
+}
+
+//swap f in for the scene, objects whose line means the same keep their mesh
+//and only the others are built. the view and the sun only move when the file
+//moved them, so a reload doesn't undo where the keys took them. how many
+//objects were built, -1 if a mesh file didn't load and nothing changed
+int applyScene(SceneFile& f)
+{
+    static const Mesh cube = buildCube();
+    int count = (int)f.objects.size();
+
+    unordered_map<string, int> old;
+    for (size_t i = 0; i < sceneFile.objects.size(); i++)
+        old[sceneFile.objects[i].name] = (int)i;
+
+    //where every object comes from, the mesh files are all read before anything changes
+    vector<int> from(count, -1);
+    unordered_map<string, Mesh> files;
+    for (int i = 0; i < count; i++)
+    {
+        const SceneObject& o = f.objects[i];
+        unordered_map<string, int>::iterator it = old.find(o.name);
+        if (sceneLoaded && it != old.end() && sceneFile.objects[it->second] == o)
+            from[i] = it->second;
+        else if (!o.path.empty() && !files.count(o.path))
+        {
+            Mesh& mesh = files[o.path];
+            if (!loadOBJ(o.path.c_str(), mesh))
+            {
+                cout << "could not load " << o.path << "\n";
+                return -1;
+            }
+        }
+    }
+
+    vector<Mesh> next(count);
+    int built = 0;
+    bool same = count == sceneMeshes;
+    for (int i = 0; i < count; i++)
+    {
+        const SceneObject& o = f.objects[i];
+        if (from[i] >= 0)
+        {
+            swap(next[i], meshes[from[i]]);
+            same = same && from[i] == i;
+            continue;
+        }
+        next[i] = o.path.empty() ? cube : files[o.path];
+        placeObject(next[i], o);
+        built++;
+        same = false;
+    }
+
+    for (size_t i = sceneMeshes; i < meshes.size(); i++)
+        next.push_back(meshes[i]);
+    meshes.swap(next);
+    sceneMeshes = count;
+
+    //objects that only moved or changed size keep the ray tree, it is refit
+    vector<string> topology(count);
+    for (int i = 0; i < count; i++)
+        topology[i] = topologyKey(f.objects[i], meshes[i]);
+    if (topology != sceneTopology)
+        geometryVersion++;
+    else if (!same)
+        geometryMoves++;
+    sceneTopology.swap(topology);
+
+    for (size_t i = 0; i < f.materials.size(); i++)
+        bakeBRDF(f.materials[i]);
+    sceneMaterials = f.materials;
+    materialNames = f.materialNames;
+    if (!f.lights.empty() || !sceneFile.lights.empty())
+        fillLights = f.lights;
+
+    const StartView &a = f.view, &b = sceneFile.view;
+    if (!sceneLoaded || memcmp(&a, &b, sizeof(StartView)) != 0)
+    {
+        startView = f.view;
+        placeCamera(startView);
+    }
+    if (!sceneLoaded || f.sun.x != sceneFile.sun.x || f.sun.y != sceneFile.sun.y || f.sun.z != sceneFile.sun.z)
+        sunShine = f.sun;
+
+    sceneFile.view = f.view;
+    sceneFile.sun = f.sun;
+    sceneFile.lights.swap(f.lights);
+    sceneFile.materials.swap(f.materials);
+    sceneFile.materialNames.swap(f.materialNames);
+    sceneFile.objects.swap(f.objects);
+    sceneLoaded = true;
+    return built;
+}
+
+//read path and swap it in, a file that doesn't parse leaves the scene as it was
+bool loadScene(const char* path)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    ifstream in(path, ios::binary);
+    if (!in)
+    {
+        cout << "could not load " << path << "\n";
+        return false;
+    }
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    SceneFile f;
+    if (!parseScene(text, path, f))
+        return false;
+    int built = applyScene(f);
+    if (built < 0)
+        return false;
+    scenePath = path;
+    cout << path << ": " << sceneMeshes << " objects, " << built << " built, " << sceneMeshes - built << " kept in "
+         << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms\n";
+    return true;
+}
+
+//tells idle when the scene file was saved. on linux inotify watches its
+//directory, editors often save by renaming a new file over the old one,
+//elsewhere or if that fails its time and size are looked at twice a second
+class FileWatcher
+{
+    public:
+        FileWatcher() : fd(-1), mtime(0), size(-1) {}
+        ~FileWatcher()
+        {
+#ifdef __linux__
+            if (fd >= 0)
+                close(fd);
+#endif
+        }
+
+        void watch(const string& p)
+        {
+            path = p;
+            size_t slash = path.find_last_of("/\\");
+            file = slash == string::npos ? path : path.substr(slash + 1);
+#ifdef __linux__
+            string dir = slash == string::npos ? string(".") : path.substr(0, slash + 1);
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+#endif
+            look(mtime, size);
+            lastPoll = chrono::steady_clock::now();
+        }
+
+        //true once per save, never blocks
+        bool changed()
+        {
+            if (path.empty())
+                return false;
+#ifdef __linux__
+            if (fd >= 0)
+            {
+                bool saved = false;
+                alignas(inotify_event) char buffer[4096];
+                ssize_t n;
+                while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+                    for (char* e = buffer; e < buffer + n; )
+                    {
+                        const inotify_event* ev = (const inotify_event*)e;
+                        if (ev->len && file == ev->name)
+                            saved = true;
+                        e += sizeof(inotify_event) + ev->len;
+                    }
+                return saved;
+            }
+#endif
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            if (now - lastPoll < chrono::milliseconds(500))
+                return false;
+            lastPoll = now;
+            time_t t;
+            long long s;
+            look(t, s);
+            if (t == mtime && s == size)
+                return false;
+            mtime = t;
+            size = s;
+            return true;
+        }
+
+    private:
+        string path, file;
+        int fd;
+        time_t mtime;
+        long long size;
+        chrono::steady_clock::time_point lastPoll;
+
+        void look(time_t& t, long long& s)
+        {
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0)
+            {
+                t = 0;
+                s = -1;
+                return;
+            }
+            t = st.st_mtime;
+            s = st.st_size;
+        }
+};
+
+FileWatcher sceneWatcher;
+
+//count cubes on a grid read from text, then the same text with one of them
+//moved, which should build that one again and light only its vertices
+int benchScene(int count)
+{
+    int side = 1;
+    while (side * side * side < count)
+        side++;
+    vector<string> lines(count);
+    char buffer[128];
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(buffer, sizeof(buffer), "cube c%d %s %d %d %d .5\n", i, i % 2 ? "silver" : "brass",
+                 -3 * (i % side), -3 * ((i / side) % side), -3 * (i / (side * side)));
+        lines[i] = buffer;
+    }
+    string text = "camera 3 3 3 0 0 0 0 1 0\nsun 15 20 10\n";
+    for (int i = 0; i < count; i++)
+        text += lines[i];
+
+    ShadedBatch batch;
+    for (int run = 0; run < 2; run++)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        SceneFile f;
+        if (!parseScene(text, "bench", f))
+            return 1;
+        chrono::steady_clock::time_point parsed = chrono::steady_clock::now();
+        int built = applyScene(f);
+        chrono::steady_clock::time_point applied = chrono::steady_clock::now();
+        cout << (run ? "one moved: " : "first read: ") << text.size() / 1024 << " KB parsed in "
+             << chrono::duration<double, milli>(parsed - start).count() << " ms, "
+             << built << " of " << count << " objects built in " << chrono::duration<double, milli>(applied - parsed).count() << " ms\n";
+
+        shadeScene(batch, true);
+        cout << "    ";
+        reportDiffuseCache(batch.cache);
+
+        //the next read makes the object in the middle bigger
+        size_t end = text.find('\n', text.find("cube c" + to_string(count / 2) + " "));
+        text.replace(end - 2, 2, ".75");
+    }
+    return 0;
+}
+
+//regression harness -------------------------------
+//canonical scenes drawn headless and held against the images and frame times
+//an earlier run recorded in the same directory, the ones kept with the source
+//are in regress/. images are compared in
+//CIELAB, a pixel has changed when it is more than a just noticeable
+//difference away, and a scene fails when too many pixels changed or its median
+//frame time, after a few warm-up frames, got more than regressSlower times
+//slower than recorded. regressIgnoreTimes still reports slow frames but only
+//fails on images, for machines nothing was recorded on. a missing image or
+//time fails too, unless regressRecord is set, then it is recorded instead,
+//delete them and record to take new ones. the renderer flags on the command
+//line still apply, so -generic or -nocache check those paths against the same
+//references
+
+const double REGRESS_JND = 2.3;         //delta E
+const double REGRESS_CHANGED = .001;    //share of the pixels allowed past it
+double regressSlower = 1.25;            //times the recorded frame time fails
+bool regressIgnoreTimes = false;        //slower frames are only reported
+bool regressRecord = false;             //missing references are recorded instead of failing
+const char* REGRESS_DIR = "regress";    //the references kept with the source, from the top of the tree
+const double REGRESS_SLACK_MS = .5;     //timer noise on top, matters for the fast scenes
+const int REGRESS_WARMUP = 3;           //untimed frames first, caches, workers and clocks come up to speed
+const int REGRESS_ROUNDS = 15;          //frames timed per scene at least, the median counts
+const double REGRESS_TIMED_MS = 500;    //and more until this long went by
+
+struct RegressScene
+{
+    string name;
+    function<void()> setup;     //from the defaults regress puts back first
+};
+
+//8 bit srgb to L*a*b* under d65
+void srgbToLab(unsigned c, double lab[3])
+{
+    static double linear[256];
+    if (linear[255] == 0)
+        for (int i = 0; i < 256; i++)
+        {
+            double v = i / 255.0;
+            linear[i] = v <= .04045 ? v / 12.92 : pow((v + .055) / 1.055, 2.4);
+        }
+    double r = linear[c & 255], g = linear[(c >> 8) & 255], b = linear[(c >> 16) & 255];
+    double xyz[3] = { (.4124 * r + .3576 * g + .1805 * b) / .95047,
+                       .2126 * r + .7152 * g + .0722 * b,
+                      (.0193 * r + .1192 * g + .9505 * b) / 1.08883 };
+    for (int k = 0; k < 3; k++)
+        xyz[k] = xyz[k] > .008856 ? cbrt(xyz[k]) : 7.787 * xyz[k] + 16.0 / 116;
+    lab[0] = 116 * xyz[1] - 16;
+    lab[1] = 500 * (xyz[0] - xyz[1]);
+    lab[2] = 200 * (xyz[1] - xyz[2]);
+}
+
+//one whole frame from the start view without a window
+void renderHeadless(Framebuffer& fb)
+{
+    progress.restart();
+    placeCamera(startView);
+    applyQuality();
+    shadeScene(frameBatch, false);
+    finishBatch(frameBatch);
+    //a progressive picture is whole after its last refinement pass
+    do
+        renderSoftware(frameBatch, cam, fb);
+    while (rayTracing && progressive && !progress.done());
+}
+
+int regress(const string& dir)
+{
+    const StartView view = { { 3, 3, 3 }, { 0, 0, 0 }, { 0, 1, 0 }, 30 };
+    vector<RegressScene> scenes = {
+        { "brass_cube",            [] {} },
+        { "silver_cube",           [] { GS = true; } },
+        { "brass_cube_per_pixel",  [] { perPixelWanted = true; } },
+        { "silver_cube_per_pixel", [] { GS = true; perPixelWanted = true; } },
+        { "many_lights",           [] { lightRadius = 30; makeFillLights(16); perPixelWanted = true; } },
+        { "crowd",                 [] { addCrowd(200); makeFillLights(4); } },
+        { "quad_view",             [] { addCrowd(30); quadView = true; } }
+    };
+    //the sun going round the cube, frame after frame through the same batch
+    for (int i = 0; i < 4; i++)
+        scenes.push_back({ "moving_sun_" + to_string(i), [i] {
+            double angle = .5 + i * .6;
+            sunShine = Point3(18 * cos(angle), 20 - 3 * i, 18 * sin(angle));
+        } });
+
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+    //recorded frame times, a name and milliseconds a line
+    string timesPath = dir + "/times.txt";
+    vector<pair<string, double> > times;
+    {
+        ifstream in(timesPath.c_str());
+        string name;
+        double ms;
+        while (in >> name >> ms)
+            times.push_back(make_pair(name, ms));
+    }
+
+    int failed = 0, slower = 0, recorded = 0;
+    Framebuffer fb;
+    for (size_t si = 0; si < scenes.size(); si++)
+    {
+        const RegressScene& scene = scenes[si];
+        meshes.assign(1, buildCube());
+        sceneMaterials = { brass, silver };
+        GS = false;
+        sunShine = Point3(15, 20, 10);
+        lightRadius = 0;
+        fillLights.clear();
+        perPixelWanted = false;
+        quadView = false;
+        adaptiveQuality = false;
+        startView = view;
+        scene.setup();
+
+        for (int i = 0; i < REGRESS_WARMUP; i++)
+            renderHeadless(fb);
+        //the median shrugs off the frames another process got in the way of
+        vector<double> frameMs;
+        double spent = 0;
+        while ((int)frameMs.size() < REGRESS_ROUNDS || spent < REGRESS_TIMED_MS)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            renderHeadless(fb);
+            frameMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            spent += frameMs.back();
+        }
+        nth_element(frameMs.begin(), frameMs.begin() + frameMs.size() / 2, frameMs.end());
+        double median = frameMs[frameMs.size() / 2];
+        cout << scene.name << ": ";
+
+        //the image
+        string imagePath = dir + "/" + scene.name + ".ppm";
+        int w, h;
+        vector<unsigned char> rgb;
+        bool fail = false;
+        if (!ifstream(imagePath.c_str()) && !regressRecord)
+        {
+            cout << "FAIL, no reference " << imagePath;
+            fail = true;
+        }
+        else if (!ifstream(imagePath.c_str()))
+        {
+            if (!writePPM(imagePath.c_str(), fb))
+            {
+                cout << "could not write " << imagePath << "\n";
+                return 1;
+            }
+            cout << "image recorded";
+            recorded++;
+        }
+        else if (!readPPM(imagePath.c_str(), w, h, rgb) || w != fb.w || h != fb.h)
+        {
+            cout << "FAIL, " << imagePath << " isn't a " << fb.w << "x" << fb.h << " ppm";
+            fail = true;
+        }
+        else
+        {
+            int changed = 0;
+            double worst = 0, total = 0;
+            vector<unsigned> diff(w * h);
+            for (int i = 0; i < w * h; i++)
+            {
+                unsigned ref = rgb[3 * i] | rgb[3 * i + 1] << 8 | rgb[3 * i + 2] << 16;
+                double a[3], b[3];
+                srgbToLab(ref, a);
+                srgbToLab(fb.color[i], b);
+                double e = sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]));
+                worst = max(worst, e);
+                total += e;
+                changed += e > REGRESS_JND;
+                //the reference dimmed with what changed in red
+                unsigned dim = (unsigned)(a[0] * .8), red = (unsigned)min(255.0, dim + e * 10);
+                diff[i] = red | dim << 8 | dim << 16;
+            }
+            fail = changed > REGRESS_CHANGED * w * h;
+            cout << (fail ? "FAIL, " : "image ok, ") << changed << " pixels past delta E " << REGRESS_JND
+                 << " (mean " << total / (w * h) << ", max " << worst << ")";
+            if (fail)
+            {
+                string diffPath = dir + "/" + scene.name + ".diff.ppm";
+                writePPM(diffPath.c_str(), w, h, &diff[0]);
+                cout << ", see " << diffPath;
+            }
+        }
+
+        //the frame time
+        size_t t = 0;
+        while (t < times.size() && times[t].first != scene.name)
+            t++;
+        if (t == times.size() && !regressRecord)
+        {
+            cout << ", FAIL, no time recorded in " << timesPath << "\n";
+            fail = true;
+        }
+        else if (t == times.size())
+        {
+            times.push_back(make_pair(scene.name, median));
+            cout << ", " << median << " ms recorded\n";
+            recorded++;
+        }
+        else
+        {
+            bool slow = median > times[t].second * regressSlower + REGRESS_SLACK_MS;
+            cout << (slow ? ", SLOWER: " : ", ") << median << " ms against " << times[t].second << " ms\n";
+            slower += slow;
+            fail = fail || (slow && !regressIgnoreTimes);
+        }
+        failed += fail;
+    }
+
+    if (recorded)
+    {
+        ofstream out(timesPath.c_str());
+        for (size_t t = 0; t < times.size(); t++)
+            out << times[t].first << " " << times[t].second << "\n";
+        if (!out)
+        {
+            cout << "could not write " << timesPath << "\n";
+            return 1;
+        }
+    }
+    cout << "regress: " << scenes.size() << " scenes, " << failed << " failed, " << slower << " slower"
+         << (regressIgnoreTimes ? " (ignored)" : "") << ", " << recorded << " references recorded in " << dir << "\n";
+    return failed ? 1 : 0;
+}
+
+//the sun, a line to it and its label
+void drawSun()
+{
+    glPushMatrix();
+        //draw a line to the sunshine 
+        glBegin(GL_LINES);
+            glColor3f(1,1,.5);
+            glVertex3d(1,1,1);
+            glVertex3d(sunShine.x,sunShine.y,sunShine.z);   
+        glEnd();
+
+        glTranslated(sunShine.x,sunShine.y,sunShine.z);
+
+        glColor3d(1,1,0);
+        glutSolidSphere(1,sunSlices,sunSlices);
+
+        glColor3f(0,0,0);
+        string str = "Sunshine";
+        glRasterPos3d(1, 1, 1);
+        for (int i = 0; i < 8; i++)
+            glutBitmapCharacter(GLUT_BITMAP_8_BY_13, (int)str[i]); 
+
+        
+    glPopMatrix();
+}
+
+//the axis and the sun over each quarter of the window with that view's camera,
+//then the whole window back to the main camera
+void drawViewportMarkers()
+{
+    for (int n = 0; n < QUAD_VIEWS; n++)
+    {
+        Viewport& v = viewports[n];
+        int x, y, w, h;
+        quarter(n, VIEW_W, VIEW_H, x, y, w, h);
+        glViewport(x, y, w, h);
+
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+        glColor3f(0,0,0);
+        glRasterPos2f(-.95f, .88f);
+        for (const char* c = v.name; *c; c++)
+            glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *c);
+
+        v.cam.setShape(v.cam.viewAngle, v.cam.aspect, v.cam.nearDist, v.cam.farDist);
+        v.cam.setModelviewMatrix();
+        glPushMatrix();
+            axis(1);
+        glPopMatrix();
+        drawSun();
+    }
+    glViewport(0, 0, VIEW_W, VIEW_H);
+    cam.setShape(cam.viewAngle, cam.aspect, cam.nearDist, cam.farDist);
+    cam.setModelviewMatrix();
+}
+
+void display(void)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    applyQuality();
+
+    //openGL clamps every color, so hdr always goes through the software path, as does the g-buffer,
+    //and the quad view, whose views each need their own specular
+    bool software = softwareRender || hdrMode || deferredShading || rayTracing || texturing || (normalMapping && perPixelShading) || quadView;
+
+    //shade and pack the scene first, the software path needs it before anything is drawn,
+    //it lights only what gets past its occlusion test so it takes the batch unlit
+    shadeScene(frameBatch, !software);
+    finishBatch(frameBatch);
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (software)
+    {
+        renderSoftware(frameBatch, cam, frameBuffer);
+        blitFramebuffer(frameBuffer);
+    }
+
+    //the culling and cache numbers change every frame, once a second is enough to read
+    static chrono::steady_clock::time_point lastReport = start;
+    if (start - lastReport >= chrono::seconds(1))
+    {
+        if (software && occlusionCulling && !rayTracing)
+            reportOcclusion(tileRaster.stats);
+        if (frameBatch.cache.hits + frameBatch.cache.misses)
+            reportDiffuseCache(frameBatch.cache);
+        lastReport = start;
+    }
+
+    if (quadLayout())
+        drawViewportMarkers();
+    else
+    {
+        //draw axis lines, x = red, y = green, z = blue
+        glPushMatrix();
+            axis(1);
+        glPopMatrix();
+
+        if (!software)
+            drawBatchGL(frameBatch);
+
+        //draw sunshine
+        drawSun();
+    }
+
+    glFlush();
+    //wait for the gpu so the controller sees the whole frame and not vsync
+    if (adaptiveQuality)
+        glFinish();
+    measureFrame(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    captureFrame();
+    glutSwapBuffers();
+
+}
+
+//input --------------------------------------------
+//the key callbacks only record what happened, each frame drains the queue,
+//applies one-shot keys once and moves the camera and the light for as long
+//as their keys are held, stepped at a fixed rate so speed doesn't follow frame rate
+
+struct InputEvent
+{
+    int key;        //MOUSE_PICK for a click
+    bool special;   //arrow keys come from glutSpecialFunc
+    bool down;
+    int x, y;       //viewport pixel of a click, y up
+};
+
+const int MOUSE_PICK = -1;
+
+class InputQueue
+{
+    public:
+        void push(int key, bool special, bool down, int x = 0, int y = 0)
+        {
+            InputEvent e = { key, special, down, x, y };
+            lock_guard<mutex> hold(lock);
+            events.push_back(e);
+        }
+
+        //hand over everything since the last frame
+        void drain(vector<InputEvent>& out)
+        {
+            out.clear();
+            lock_guard<mutex> hold(lock);
+            out.swap(events);
+        }
+
+    private:
+        mutex lock;
+        vector<InputEvent> events;
+};
+
+InputQueue input;
+
+const double SIM_STEP = 1.0 / 120;     //seconds per simulation step
+const float KEY_RATE = 30;             //held keys repeat the old one-press step this often a second
+const float REPEAT_DELAY = .25f;       //a tap is one step, holding starts moving after this
+
+//held keys and for how long, [0] normal keys and [1] glut special keys
+bool keyHeld[2][256];
+float keyHeldFor[2][256];
+
+double simBehind = 0;                  //real time the simulation still has to catch up
+chrono::steady_clock::time_point lastIdle;
+
+//the old one-press motion times scale, false if key doesn't move anything
+bool moveKey(int key, bool special, float scale)
+{
+    if (special)
+    {
+        switch (key)
+        {
+            //camera controls
+            case GLUT_KEY_LEFT:  cam.slide(-0.2 * scale, 0, 0); return true;
+            case GLUT_KEY_UP:    cam.slide(0, 0, -0.2 * scale); return true;
+            case GLUT_KEY_RIGHT: cam.slide(0.2 * scale, 0, 0);  return true;
+            case GLUT_KEY_DOWN:  cam.slide(0, 0, 0.2 * scale);  return true;
+        }
+        return false;
+    }
+
+    switch (key)
+    {
+        //camera controls
+        case 'a':    cam.yaw(-2.0 * scale); return true;
+        case 'd':    cam.yaw(2.0 * scale); return true;
+
+        case 'w':    cam.pitch(-2.0 * scale); return true;
+        case 's':    cam.pitch(2.0 * scale); return true;
+
+        case 'q':    cam.roll(-2.0 * scale); return true;
+        case 'e':    cam.roll(2.0 * scale); return true;
+
+        case '\'':   cam.slide(0.0, .2 * scale, 0); return true;
+        case '/':    cam.slide(0.0, -.2 * scale, 0); return true;
+
+        //sunshine controlls
+        case 'u':    sunShine.y += scale; return true;
+        case 'j':    sunShine.y -= scale; return true;
+
+        case 'h':    sunShine.x -= scale; return true;
+        case 'k':    sunShine.x += scale; return true;
+    }
+    return false;
+}
+
+//keys that flip a setting once per press
+void toggleKey(int key)
+{
+    switch (key)
+    {
+        //color controls
+        case 'c':    GS ? GS = false : GS = true; break;
+
+        //renderer controls
+        case 'r':    softwareRender = !softwareRender; break;
+        case 'z':    quantizePositions = !quantizePositions; reportVertexFormat(); break;
+        case 'x':    hdrMode = !hdrMode; break;
+        case 'o':    toneOperator = toneOperator == TONE_ACES ? TONE_REINHARD : TONE_ACES; break;
+        case 'b':    envLighting = !envLighting; break;
+        case 'p':    perPixelWanted = !perPixelWanted; break;
+        case 'v':    occlusionCulling = !occlusionCulling;
+                     cout << "occlusion culling " << (occlusionCulling ? "on" : "off") << "\n"; break;
+        case 'f':    deferredShading = !deferredShading;
+                     cout << "deferred shading " << (deferredShading ? "on" : "off") << "\n"; break;
+        case 't':    rayTracing = !rayTracing;
+                     cout << "ray tracing " << (rayTracing ? "on" : "off") << "\n"; break;
+        case 'T':    texturing = !texturing;
+                     if (texture.empty())
+                         makeCheckerTexture(texture, 256, mortonTexels);
+                     cout << "textures " << (texturing ? "on" : "off") << "\n"; break;
+        case 'N':    normalMapping = !normalMapping;
+                     if (normalMap.empty())
+                         makeTileNormalMap(normalMap, 256, mortonTexels, 4);
+                     cout << "normal maps " << (normalMapping ? "on" : "off") << (perPixelShading ? "" : ", they need per pixel lighting ('p')") << "\n"; break;
+        case 'V':    quadView = !quadView;
+                     cout << "quad view " << (quadView ? "on" : "off") << (rayTracing ? ", not while ray tracing ('t')" : "") << "\n"; break;
+        case 'K':    specializedShading = !specializedShading;
+                     cout << "specialized shading kernels " << (specializedShading ? "on" : "off") << "\n"; break;
+        case 'y':    brdfLookup = !brdfLookup;
+                     cout << "brdf tables " << (brdfLookup ? "on" : "off") << "\n"; break;
+        case 'l':    diffuseCaching = !diffuseCaching;
+                     cout << "diffuse cache " << (diffuseCaching ? "on" : "off") << "\n"; break;
+        case 'i':    progressive = !progressive;
+                     cout << "progressive ray tracing " << (progressive ? "on" : "off") << "\n"; break;
+        case 'n':    gbufferLayout = gbufferLayout == GBUFFER_FLOAT ? GBUFFER_OCTAHEDRAL : GBUFFER_FLOAT;
+                     cout << "g-buffer normals " << (gbufferLayout == GBUFFER_FLOAT ? "float" : "octahedral") << "\n"; break;
+        case 'm':    if (exporter.active()) exporter.stop(); else exporter.start(capturePrefix, capturePng); break;
+        case 'g':    adaptiveQuality = !adaptiveQuality;
+                     cout << "adaptive quality " << (adaptiveQuality ? "on" : "off") << "\n"; break;
+
+        case 27 : exporter.stop(); metrics.stop(); exit(1);     //their destructors wait for both writers
+    }
+}
+
+//print what is under viewport pixel x, y, the last frame's batch is traced
+//through the same tree the ray tracer uses
+void pick(int x, int y)
+{
+    const ShadedBatch& batch = frameBatch;
+    buildRayScene(rayScene, batch);
+
+    //in the quad view through the camera of the quarter that was clicked
+    const Camera* c = &cam;
+    int w = VIEW_W, h = VIEW_H;
+    for (int n = 0; quadLayout() && n < QUAD_VIEWS; n++)
+    {
+        int qx, qy;
+        quarter(n, VIEW_W, VIEW_H, qx, qy, w, h);
+        if (x >= qx && x < qx + w && y >= qy && y < qy + h)
+        {
+            c = &viewports[n].cam;
+            x -= qx;
+            y -= qy;
+            break;
+        }
+    }
+    Vector3 d = pixelDirection(*c, x, y, w, h);
+    RayHit hit;
+    if (!traceRay(rayScene, c->eye, d, c->nearDist, FLT_MAX, hit, false))
+    {
+        cout << "picked nothing\n";
+        return;
+    }
+
+    //the part the triangle came from, parts are in index order
+    size_t part = 0;
+    while (part + 1 < batch.parts.size() && batch.parts[part + 1].firstIndex <= 3 * (unsigned)hit.tri)
+        part++;
+    Point3 p = pointAlong(c->eye, d, hit.t);
+    cout << "picked " << meshes[batch.parts[part].mesh].name << " triangle " << hit.tri - batch.parts[part].firstIndex / 3
+         << " at (" << p.x << ", " << p.y << ", " << p.z << "), distance " << hit.t << "\n";
+}
+
+//the key as it is without shift. glut reports a key's release with the shift
+//state of the moment, so 'a' pressed bare comes back up as 'A' when shift
+//went down in between
+int unshifted(int key)
+{
+    if (key >= 'A' && key <= 'Z')
+        return key - 'A' + 'a';
+    switch (key)
+    {
+        case '"': return '\'';
+        case '?': return '/';
+    }
+    return key;
+}
+
+//apply the queued events, true if the picture needs redrawing
+bool processInput()
+{
+    static vector<InputEvent> events;
+    input.drain(events);
+
+    bool changed = false;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const InputEvent& e = events[i];
+        if (e.key == MOUSE_PICK)
+        {
+            pick(e.x, e.y);
+            continue;
+        }
+        int k = e.key & 255;
+        if (!e.down)
+        {
+            keyHeld[e.special][k] = false;
+            if (!e.special)
+                keyHeld[0][unshifted(k)] = false;
+            continue;
+        }
+        if (keyHeld[e.special][k])
+            continue;   //auto repeat that got through, the hold already covers it
+
+        if (moveKey(e.key, e.special, 1))
+        {
+            keyHeld[e.special][k] = true;
+            keyHeldFor[e.special][k] = 0;
+        }
+        else
+            toggleKey(e.key);
+        changed = true;
+    }
+    return changed;
+}
+
+//one fixed step of the simulation, true if anything moved
+bool stepSimulation(float dt)
+{
+    bool moved = false;
+    for (int s = 0; s < 2; s++)
+        for (int k = 0; k < 256; k++)
+        {
+            if (!keyHeld[s][k])
+                continue;
+            keyHeldFor[s][k] += dt;
+            if (keyHeldFor[s][k] > REPEAT_DELAY)
+                moved = moveKey(k, s == 1, KEY_RATE * dt) || moved;
+        }
+    return moved;
+}
+
+//glut idle callback, runs the simulation up to now and asks for one frame if anything changed
+void idle()
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    //a long stall (window drag, breakpoint) shouldn't turn into a huge jump
+    simBehind += min(.25, chrono::duration<double>(now - lastIdle).count());
+    lastIdle = now;
+
+    bool changed = processInput();
+    for (; simBehind >= SIM_STEP; simBehind -= SIM_STEP)
+        changed = stepSimulation((float)SIM_STEP) || changed;
+
+    //a saved scene file is read again, whatever it changed shows in the next frame
+    if (sceneWatcher.changed() && loadScene(scenePath.c_str()))
+        changed = true;
+
+    //a still view gets the next progressive pass instead
+    if (changed)
+        progress.restart();
+    if (changed || (rayTracing && progressive && !progress.done()))
+        glutPostRedisplay();
+    else
+        this_thread::sleep_for(chrono::milliseconds(1));
+}
+
+void keyboardDrawPrompt(unsigned char key, int xmouse, int ymouse) {
+    input.push(key, false, true);
+}
+
+void keyboardUp(unsigned char key, int xmouse, int ymouse) {
+    input.push(key, false, false);
+}
+
+void SpecialKeys(int key, int x, int y)
+{
+    input.push(key, true, true);
+}
+
+void SpecialKeysUp(int key, int x, int y)
+{
+    input.push(key, true, false);
+}
+
+//a left click picks whatever is under it, glut counts y from the top of the window
+void mouse(int button, int state, int x, int y)
+{
+    int vy = glutGet(GLUT_WINDOW_HEIGHT) - 1 - y;
+    if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN && x < VIEW_W && vy >= 0 && vy < VIEW_H)
+        input.push(MOUSE_PICK, false, true, x, vy);
+}
+
+
+//command line flags can come in any order
+bool hasFlag(int argc, char **argv, const char* flag)
+{
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], flag) == 0)
+            return true;
+    return false;
+}
+
+//the argument after flag, 0 if it isn't there
+char* flagValue(int argc, char **argv, const char* flag)
+{
+    for (int i = 1; i + 1 < argc; i++)
+        if (strcmp(argv[i], flag) == 0)
+            return argv[i + 1];
+    return 0;
+}
+
+
+// Runs the code setting the GL functions to the appropriate from above
+//<<<<<<<<<<<<<<<<<<<<<<<< main >>>>>>>>>>>>>>>>>>>>>>
+int main(int argc, char **argv) {
+	
+	//-precision compares the float shading path against double and exits
+	if (hasFlag(argc, argv, "-precision"))
+		return precisionCheck(100000, 1e-4);
+
+	//-brdf-check measures the brdf tables against the analytic model and exits,
+	//-brdf shades through them
+	bakeBRDF(brass);
+	bakeBRDF(silver);
+	if (hasFlag(argc, argv, "-brdf-check"))
+		return brdfCheck(1000000);
+	brdfLookup = hasFlag(argc, argv, "-brdf");
+
+	//-bench-kernels times the specialized shading kernels against the generic functions and exits,
+	//-generic shades through the generic ones
+	specializedShading = !hasFlag(argc, argv, "-generic");
+	if (hasFlag(argc, argv, "-bench-kernels"))
+		return benchKernels(1000000);
+
+	buildSrgbLUT();
+	hdrMode = hasFlag(argc, argv, "-hdr");
+
+	//-bench-tonemap times the hdr post process at 1080p and exits
+	if (hasFlag(argc, argv, "-bench-tonemap"))
+		return benchToneMap(50);
+
+	//-bench-texture [size] times texel fetches from a morton and a row major texture and exits
+	if (hasFlag(argc, argv, "-bench-texture"))
+	{
+		const char* n = flagValue(argc, argv, "-bench-texture");
+		int size = 2048;
+		while (n && atoi(n) > size && size < 8192)
+			size *= 2;
+		return benchTexture(size);
+	}
+
+	//-bench-scene [objects] times reading a scene of that many cubes and reading it again with one changed and exits
+	if (hasFlag(argc, argv, "-bench-scene"))
+	{
+		const char* n = flagValue(argc, argv, "-bench-scene");
+		return benchScene(n && atoi(n) > 0 ? atoi(n) : 100000);
+	}
+
+	//-bench-bvh [triangles] times building, refitting and tracing a generated mesh and exits
+	if (hasFlag(argc, argv, "-bench-bvh"))
+	{
+		const char* n = flagValue(argc, argv, "-bench-bvh");
+		return benchBVH(n && atoi(n) > 0 ? atoi(n) : 1000000);
+	}
+
+	//-env file.ppm swaps the built in sky for an equirectangular map, -sky just turns the sky on
+	makeSkyEnvironment(environment);
+	envLighting = hasFlag(argc, argv, "-sky");
+	if (const char* path = flagValue(argc, argv, "-env"))
+	{
+		if (!loadEnvironment(path, environment))
+		{
+			cout << "could not load " << path << "\n";
+			return 1;
+		}
+		envLighting = true;
+	}
+
+	//-radius r makes every light fall off to nothing at distance r, -lights n adds n fill lights,
+	//-perpixel lights every pixel in the software path, -budget ms turns on the adaptive quality controller
+	if (const char* r = flagValue(argc, argv, "-radius"))
+		lightRadius = atof(r);
+	if (const char* n = flagValue(argc, argv, "-lights"))
+		makeFillLights(atoi(n));
+	perPixelWanted = hasFlag(argc, argv, "-perpixel");
+	if (const char* ms = flagValue(argc, argv, "-budget"))
+	{
+		quality.setBudget(atof(ms));
+		adaptiveQuality = true;
+	}
+
+	//-metrics file writes the render counters there in prometheus text format every
+	//-metrics-every seconds (5 without it)
+	if (const char* path = flagValue(argc, argv, "-metrics"))
+	{
+		const char* every = flagValue(argc, argv, "-metrics-every");
+		metrics.start(path, every && atof(every) > 0 ? atof(every) : 5);
+	}
+
+	//-capture prefix saves every displayed frame from the start, -png writes png instead of ppm
+	capturePng = hasFlag(argc, argv, "-png");
+	if (const char* prefix = flagValue(argc, argv, "-capture"))
+		capturePrefix = prefix;
+
+	//-scene file reads the view, the lights, the materials and the objects from a file and
+	//reads it again whenever it is saved, without one there is just the cube
+	if (const char* path = flagValue(argc, argv, "-scene"))
+	{
+		if (!loadScene(path))
+			return 1;
+		sceneWatcher.watch(path);
+	}
+	else
+		meshes.push_back(buildCube());
+
+	//-crowd n hides n more cubes behind the first, -nocull turns the occlusion culling off
+	if (const char* n = flagValue(argc, argv, "-crowd"))
+		addCrowd(atoi(n));
+	occlusionCulling = !hasFlag(argc, argv, "-nocull");
+
+	//-texture [file.ppm] maps a texture over every mesh in the software path, a checkerboard
+	//without a file, -linear-texels keeps its texels in rows instead of z-order
+	mortonTexels = !hasFlag(argc, argv, "-linear-texels");
+	if (hasFlag(argc, argv, "-texture"))
+	{
+		const char* path = flagValue(argc, argv, "-texture");
+		if (path && path[0] != '-')
+		{
+			if (!loadTexture(path, texture, mortonTexels))
+			{
+				cout << "could not load " << path << "\n";
+				return 1;
+			}
+		}
+		else
+			makeCheckerTexture(texture, 256, mortonTexels);
+		texturing = true;
+	}
+
+	//-normalmap [file.ppm] bumps the per pixel lighting with a tangent space normal map, tiles without a file
+	if (hasFlag(argc, argv, "-normalmap"))
+	{
+		const char* path = flagValue(argc, argv, "-normalmap");
+		if (path && path[0] != '-')
+		{
+			if (!loadTexture(path, normalMap, mortonTexels))
+			{
+				cout << "could not load " << path << "\n";
+				return 1;
+			}
+		}
+		else
+			makeTileNormalMap(normalMap, 256, mortonTexels, 4);
+		normalMapping = true;
+	}
+
+	//-quad draws top, front and side views next to the camera's, rasterized in software
+	quadView = hasFlag(argc, argv, "-quad");
+
+	//-deferred lights the software path from a g-buffer, -octahedral packs its normals into 32 bits
+	deferredShading = hasFlag(argc, argv, "-deferred");
+	if (hasFlag(argc, argv, "-octahedral"))
+		gbufferLayout = GBUFFER_OCTAHEDRAL;
+
+	//-raytrace renders the software path with shadows and reflections instead of rasterizing,
+	//-nopackets traces it one ray at a time, -noprogressive traces every frame at full resolution
+	rayTracing = hasFlag(argc, argv, "-raytrace");
+	rayPackets = !hasFlag(argc, argv, "-nopackets");
+	progressive = !hasFlag(argc, argv, "-noprogressive");
+
+	//-obj file adds a mesh to the scene, its normals are smoothed on load
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (strcmp(argv[i], "-obj") != 0)
+			continue;
+		Mesh mesh;
+		if (!loadOBJ(argv[i + 1], mesh))
+		{
+			cout << "could not load " << argv[i + 1] << "\n";
+			return 1;
+		}
+		cout << mesh.name << ": " << mesh.vert.size() << " vertices, " << mesh.triangles() << " triangles\n";
+		meshes.push_back(mesh);
+	}
+
+	//-bench-cache [frames] times relighting the scene per frame with and without the diffuse cache and exits,
+	//-nocache turns the cache off
+	diffuseCaching = !hasFlag(argc, argv, "-nocache");
+	if (hasFlag(argc, argv, "-bench-cache"))
+	{
+		const char* n = flagValue(argc, argv, "-bench-cache");
+		cam.setShape(30.0, 64.0/48.0, .5, 100.0);
+		return benchDiffuseCache(n && atoi(n) > 0 ? atoi(n) : 100);
+	}
+
+	//-regress [dir] draws the canonical scenes headless and checks them against the images and
+	//frame times recorded in dir, regress/ by default, and exits, -regress-record records
+	//whatever is missing there instead of failing on it,
+	//-regress-slower x fails frames x times slower than recorded instead of 1.25,
+	//-regress-ignore-times only reports them and fails on changed images alone
+	if (const char* x = flagValue(argc, argv, "-regress-slower"))
+		regressSlower = atof(x);
+	regressIgnoreTimes = hasFlag(argc, argv, "-regress-ignore-times");
+	regressRecord = hasFlag(argc, argv, "-regress-record");
+	if (hasFlag(argc, argv, "-regress"))
+	{
+		const char* dir = flagValue(argc, argv, "-regress");
+		return regress(dir && dir[0] != '-' ? dir : REGRESS_DIR);
+	}
+
+	//-bench-packets traces the start view with single rays and with packets and exits
+	if (hasFlag(argc, argv, "-bench-packets"))
+	{
+		placeCamera(startView);
+		shadeScene(frameBatch, false);
+		return benchPackets(frameBatch, cam);
+	}
+
+	//-ppm file renders one frame in software without opening a window
+	if (const char* path = flagValue(argc, argv, "-ppm"))
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		renderHeadless(frameBuffer);
+		if (occlusionCulling && !rayTracing)
+			reportOcclusion(tileRaster.stats);
+		if (deferredShading && !rayTracing)
+			reportDeferred((int)frameBatch.lights.size());
+		countFrame(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+		bool written = writePPM(path, frameBuffer);
+		metrics.finish();
+		return written ? 0 : 1;
+	}
 
-// Runs the code setting the GL functions to the appropriate from above
-//<<<<<<<<<<<<<<<<<<<<<<<< main >>>>>>>>>>>>>>>>>>>>>>
-int main(int argc, char **argv) {
-	
 	cout << "Camera tilt: 'w', 'a', 's', 'd', '/', '(single quote)'\n"; 
 	cout << "Camera movement: arrow keys\n"; 
 	cout << "Light movement: 'u','h','j','k'\n"; 
-	cout << "Color switch: 'c'"; 
+	cout << "Color switch: 'c'\n"; 
+	cout << "Software renderer: 'r', 16 bit positions: 'z'\n"; 
+	cout << "HDR: 'x', tone operator (ACES/Reinhard): 'o'\n"; 
+	cout << "Environment lighting: 'b'\n"; 
+	cout << "Per pixel lighting: 'p', adaptive quality: 'g'\n"; 
+	cout << "Diffuse cache: 'l', brdf tables: 'y', specialized shading kernels: 'K'\n"; 
+	cout << "Textures: 'T', normal maps (per pixel lighting only): 'N'\n"; 
+	cout << "Occlusion culling: 'v', quad view: 'V'\n"; 
+	cout << "Deferred shading: 'f', octahedral g-buffer normals: 'n'\n"; 
+	cout << "Ray tracing: 't', progressive while moving: 'i', pick a triangle: left click\n"; 
+	cout << "Capture frames to disk: 'm'\n"; 
+	reportVertexFormat();
 		
 	glutInit(&argc, argv);          // initialize the toolkit
-	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB); // set the display mode
+	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH); // set the display mode
 	glutInitWindowSize(680,480);     // set the window size
 	glutInitWindowPosition(680, 0); // set the window position on the screen
 	glutCreateWindow("Light"); // open the screen window(with its exciting title)
+	glReady = true;
     glutKeyboardFunc(keyboardDrawPrompt); // register the keyboard action function
+    glutKeyboardUpFunc(keyboardUp);
     glutSpecialFunc(SpecialKeys);
+    glutSpecialUpFunc(SpecialKeysUp);
+    glutMouseFunc(mouse);
+    glutIgnoreKeyRepeat(1); // held keys are tracked with the up callbacks instead
+    glutIdleFunc(idle);     // runs the simulation and asks for frames
+    lastIdle = chrono::steady_clock::now();
 	glutDisplayFunc(display);     // register the redraw function
     glClearColor(0.5f,0.5,0.5f,0.0f);
+    glEnable(GL_DEPTH_TEST);
     glColor3f(0.0f,0.0f,0.0f);
-    glViewport(0,0,640,430);
+    glViewport(0,0,VIEW_W,VIEW_H);
     //eye, look, up
-    cam.set(3,3,3,0,0,0,0,1,0);
-    cam.setShape(30.0, 64.0/48.0, .5, 100.0);
+    placeCamera(startView);
+	if (flagValue(argc, argv, "-capture"))
+		exporter.start(capturePrefix, capturePng);
 	glutMainLoop(); 		     // go into a perpetual loop
 	
 }